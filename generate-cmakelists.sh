@@ -307,6 +307,11 @@ generate_cmake_content()
     echo "    \${WARNING_FLAGS_LIST}" >> "$output_file"
     echo ")" >> "$output_file"
 
+    # Timings from an unoptimized build say nothing, so the microbenchmark turns the optimizer back on
+    if [[ $target == microbench ]]; then
+      echo "target_compile_options($target PRIVATE -O2)" >> "$output_file"
+    fi
+
     echo "# Add target_link_libraries for $target" >> "$output_file"
     echo "" >> "$output_file"
   done
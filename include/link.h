@@ -0,0 +1,39 @@
+#ifndef LINK_H
+#define LINK_H
+
+#include "protocol.h"
+#include "tuning.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define LINK_BUFFER_SIZE (FRAME_HEADER_SIZE + MAX_FRAME_CONTENT)    // Always room for one whole frame
+#define LINK_MAX_PENDING_OUTPUT (16 * LINK_BUFFER_SIZE)             // A peer this far behind is dropped rather than buffered forever
+#define LINK_MAX_POOLED_BUFFERS 16                                  // Drained buffers kept for reuse, the rest go back to the heap
+
+typedef struct
+{
+    int       fd;
+    bool      closing;
+    bool      held;          // The owner is writing bytes of its own straight to the socket, new frames queue behind them
+    Heartbeat heartbeat;
+    uint8_t  *rxBuffer;      // Only held while part of a frame is waiting for the rest
+    size_t    rxLength;
+    uint8_t  *txBuffer;      // Only held while output is waiting for the socket
+    size_t    txLength;
+    size_t    txCapacity;
+} Link;
+
+void    linkSend(Link *link, struct iovec *parts, int count);
+void    linkSendPacket(Link *link, const char *content, size_t length);
+void    linkSendEncoded(Link *link, const uint8_t *frame, size_t length);
+void    linkFlush(Link *link);
+ssize_t linkRead(Link *link, uint8_t *scratch, const SocketTuning *tuning, uint8_t **buffer);
+void    linkKeepPartial(Link *link, const uint8_t *scratch, size_t length, size_t offset);
+void    linkClose(Link *link);
+size_t  linkBufferedBytes(const Link *link);
+size_t  linkPooledBytes(void);
+
+#endif
@@ -0,0 +1,183 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CURRENT_VERSION 1                // Current version of the protocol
+#define FRAME_HEADER_SIZE 3              // Version byte + 16 bit content length
+#define MAX_FRAME_CONTENT 65535          // Largest content a 16 bit length can describe
+#define HEARTBEAT_INTERVAL_MS 1000       // Default time between pings
+#define HEARTBEAT_MAX_MISSES 3           // Default missed heartbeats before a peer is dead
+#define HEARTBEAT_PING "/ping"           // Ping frame prefix, followed by the sender's timestamp
+#define HEARTBEAT_PONG "/pong"           // Pong frame prefix, echoes the ping timestamp
+#define MICROSECONDS_PER_MILLISECOND 1000
+#define START_REQUEST "/s"               // Start the server
+#define STOP_REQUEST "/q"                // Stop the server
+#define STREAM_LOG_REQUEST "/l"          // Ask for the server log
+#define STREAM_TABLE_REQUEST "/t"        // Ask for the connection table
+#define STREAM_BEGIN "/b"                // "/b <id> <total bytes> <name>"
+#define STREAM_CHUNK "/c"                // "/c <id> <seq>\n" followed by raw bytes
+#define STREAM_END "/e"                  // "/e <id> <bytes sent>"
+#define STREAM_ACK "/k"                  // "/k <id> <chunks received>"
+#define STREAM_CANCEL "/x"               // "/x <id>", the manager gave up on the download
+#define STREAM_CHUNK_SIZE 16384          // Payload bytes per chunk frame
+#define STREAM_WINDOW 8                  // Unacknowledged chunks the sender may have in flight
+#define STREAM_HEADER_SIZE 32            // Room for a chunk's text header
+#define STATE_EVENT "/u"                 // "/u <version> STARTED|STOPPED", published on every state change
+#define STATE_STARTED "STARTED"
+#define STATE_STOPPED "STOPPED"
+#define STREAM_REPLY "STREAM"            // Prefix of the server's STREAM BUSY / STREAM UNAVAILABLE replies
+#define METRIC_SUBSCRIBE "/ms"           // "/ms <metric mask> <interval ms>", a zero mask unsubscribes
+#define METRIC_UPDATE "/mu"              // "/mu " then varints: seq, base seq (0 for a keyframe), changed mask, zigzag deltas
+#define METRIC_ACK "/ma"                 // "/ma <seq>", the snapshot the next delta may be based on
+#define METRIC_DEFAULT_INTERVAL_MS 5000
+#define METRIC_MIN_INTERVAL_MS 100
+#define METRIC_KEYFRAME_MS 30000         // Full snapshot at least this often so a confused subscriber resyncs
+#define METRIC_UPDATE_SIZE 128           // Largest encoded update
+#define MEMORY_REQUEST "/m"              // Answered with "/m <connections> <bytes per connection> <buffered bytes> <pooled bytes>"
+#define MEMORY_REPLY_SIZE 96             // Room for the request and four 20 digit counts
+#define FLEET_REQUEST "/f"               // Gateway only, answered with "/f <servers> <connected>" and one line per server
+
+typedef struct
+{
+    uint8_t  version;
+    uint16_t contentLength;
+    char    *content;
+} Packet;
+
+typedef struct
+{
+    uint64_t lastUs;         // Most recent sample
+    uint64_t smoothedUs;     // Exponentially weighted moving average (TCP style, 1/8 gain)
+    uint64_t minUs;
+    uint64_t maxUs;
+    uint64_t samples;
+} RttStats;
+
+typedef struct
+{
+    uint32_t intervalMs;
+    uint32_t maxMisses;
+    uint64_t lastReceivedMs;    // Any frame from the peer counts as proof of life
+    uint64_t nextPingMs;
+    RttStats rtt;
+} Heartbeat;
+
+typedef enum
+{
+    METRIC_CONNECTIONS,
+    METRIC_MANAGERS,           // Authenticated connections
+    METRIC_RUNNING,
+    METRIC_STATE_VERSION,
+    METRIC_FRAMES_RECEIVED,
+    METRIC_BYTES_BUFFERED,
+    METRIC_BYTES_POOLED,
+    METRIC_UPTIME_SECONDS,
+    METRIC_COUNT
+} Metric;
+
+#define METRIC_ALL ((1U << METRIC_COUNT) - 1)
+
+typedef struct
+{
+    uint64_t seq;
+    uint64_t baseSeq;    // Snapshot the deltas apply to, 0 for a keyframe
+    uint32_t mask;       // Metrics present in this update
+    int64_t  deltas[METRIC_COUNT];
+} MetricUpdate;
+
+typedef struct
+{
+    uint32_t mask;              // Metrics the subscriber asked for
+    uint32_t intervalMs;
+    uint64_t nextUpdateMs;
+    uint64_t nextKeyframeMs;
+    uint64_t lastSeq;           // Last update sent
+    uint64_t pendingSeq;        // Update waiting for its ack, 0 when none
+    uint64_t ackedSeq;          // Snapshot the subscriber confirmed, deltas are taken against it
+    int64_t  pending[METRIC_COUNT];
+    int64_t  acked[METRIC_COUNT];
+} Subscription;
+
+typedef enum
+{
+    COMMAND_PING,
+    COMMAND_PONG,
+    COMMAND_STREAM_ACK,
+    COMMAND_STREAM_CANCEL,
+    COMMAND_METRIC_ACK,
+    COMMAND_START,
+    COMMAND_STOP,
+    COMMAND_LOG,
+    COMMAND_TABLE,
+    COMMAND_MEMORY,
+    COMMAND_SUBSCRIBE,
+    COMMAND_FLEET,
+    COMMAND_OTHER    // A password before authentication, UNKNOWN COMMAND after
+} Command;
+
+typedef enum
+{
+    REPLY_HEARTBEAT,
+    REPLY_STATE_EVENT,
+    REPLY_STREAM,
+    REPLY_STOPPED,
+    REPLY_STARTED,
+    REPLY_ACCEPTED,
+    REPLY_METRICS,
+    REPLY_OTHER
+} Reply;
+
+uint64_t monotonicMicros(void);
+uint64_t monotonicMillis(void);
+
+void     encodeFrameHeader(uint8_t *buffer, size_t length);
+size_t   encodeFrame(uint8_t *buffer, size_t capacity, const char *content, size_t length);
+size_t   decodeFrame(const uint8_t *buffer, size_t available, Packet *packet);
+size_t   copyFrame(const uint8_t *buffer, size_t available, Packet *packet);
+uint16_t decodeFrameLength(const uint8_t *header) __attribute__((pure));
+int      sendFrame(int sockfd, const char *content, size_t length);
+int      recvAll(int sockfd, void *buffer, size_t length, int timeoutMs);
+bool     wouldBlock(int error) __attribute__((const));
+
+bool isControlFrame(const char *content, size_t length, const char *prefix) __attribute__((pure));
+int  formatPing(char *buffer, size_t capacity, uint64_t timestampUs);
+int  formatPong(char *buffer, size_t capacity, const char *ping, size_t length);
+bool parseControlNumber(const char *content, size_t length, const char *prefix, uint64_t *value);
+bool parsePong(const char *content, size_t length, uint64_t *timestampUs);
+int  formatChunkHeader(char *buffer, size_t capacity, uint32_t id, uint32_t seq);
+bool parseChunk(const char *content, size_t length, uint32_t *id, uint32_t *seq, const char **data, size_t *dataLength);
+bool parseStreamNumbers(const char *content, size_t length, const char *prefix, uint64_t *first, uint64_t *second);
+int  formatStateEvent(char *buffer, size_t capacity, uint64_t version, bool running);
+bool parseStateEvent(const char *content, size_t length, uint64_t *version, bool *running);
+
+Command classifyCommand(const char *content, size_t length) __attribute__((pure));
+Reply   classifyReply(const char *content, size_t length) __attribute__((pure));
+
+size_t      encodeVarint(uint8_t *buffer, size_t capacity, uint64_t value);
+size_t      decodeVarint(const uint8_t *buffer, size_t length, uint64_t *value);
+size_t      encodeMetricUpdate(char *buffer, size_t capacity, uint64_t seq, const int64_t *values, const int64_t *base, uint64_t baseSeq, uint32_t mask);
+bool        decodeMetricUpdate(const char *content, size_t length, MetricUpdate *update);
+void        applyMetricUpdate(const MetricUpdate *update, int64_t *values);
+uint32_t    changedMetrics(const int64_t *values, const int64_t *base, uint32_t mask) __attribute__((pure));
+const char *metricName(Metric metric) __attribute__((const));
+bool        parseMetricNames(const char *list, uint32_t *mask);
+
+void     subscriptionConfigure(Subscription *subscription, uint32_t mask, uint64_t intervalMs);
+bool     subscriptionDue(const Subscription *subscription, uint64_t nowMs) __attribute__((pure));
+size_t   subscriptionUpdate(Subscription *subscription, const int64_t *values, uint64_t nowMs, char *buffer, size_t capacity);
+void     subscriptionOnAck(Subscription *subscription, uint64_t seq);
+uint64_t subscriptionNextEvent(const Subscription *subscription) __attribute__((pure));
+
+void     heartbeatInit(Heartbeat *heartbeat, uint32_t intervalMs, uint32_t maxMisses, uint64_t nowMs);
+void     heartbeatOnReceive(Heartbeat *heartbeat, uint64_t nowMs);
+void     heartbeatOnPing(Heartbeat *heartbeat, uint64_t nowMs);
+void     heartbeatOnPong(Heartbeat *heartbeat, uint64_t sentUs, uint64_t nowUs);
+bool     heartbeatPingDue(const Heartbeat *heartbeat, uint64_t nowMs) __attribute__((pure));
+bool     heartbeatExpired(const Heartbeat *heartbeat, uint64_t nowMs) __attribute__((pure));
+uint64_t heartbeatDeadline(const Heartbeat *heartbeat) __attribute__((pure));
+uint64_t heartbeatNextEvent(const Heartbeat *heartbeat) __attribute__((pure));
+
+#endif
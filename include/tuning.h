@@ -0,0 +1,36 @@
+#ifndef TUNING_H
+#define TUNING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TUNING_UNSET (-1)                // Leave the kernel default alone
+#define TUNING_DEFAULT_PROFILE "default"
+#define TUNING_DESCRIPTION_SIZE 512
+
+typedef struct
+{
+    const char *name;
+    int         noDelay;              // TCP_NODELAY
+    int         quickAck;             // TCP_QUICKACK, re-armed after every read
+    int         busyPollUs;           // SO_BUSY_POLL
+    int         sendBuffer;           // SO_SNDBUF
+    int         receiveBuffer;        // SO_RCVBUF
+    int         notSentLowat;         // TCP_NOTSENT_LOWAT
+    int         keepAlive;            // SO_KEEPALIVE
+    int         keepAliveIdle;        // TCP_KEEPIDLE seconds
+    int         keepAliveInterval;    // TCP_KEEPINTVL seconds
+    int         keepAliveCount;       // TCP_KEEPCNT probes
+    int         backlog;              // listen() backlog, server only
+} SocketTuning;
+
+bool findTuningProfile(const char *name, SocketTuning *tuning);
+bool loadTuningFile(const char *path, SocketTuning *tuning);
+void listTuningProfiles(char *buffer, size_t capacity);
+int  applySocketTuning(int sockfd, const SocketTuning *tuning);
+void rearmQuickAck(int sockfd, const SocketTuning *tuning);
+void describeSocketTuning(int sockfd, const SocketTuning *tuning, char *buffer, size_t capacity);
+bool raiseDescriptorLimit(uint64_t *soft, uint64_t *hard);
+
+#endif
@@ -0,0 +1,447 @@
+#include "protocol.h"
+#include "tuning.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define DEFAULT_ADDRESS "127.0.0.1"
+#define PORT 8080
+#define PASSWORD "password"
+#define DENIED "DENIED"
+#define DEFAULT_CONNECTIONS 1000
+#define DEFAULT_HOLD_SECONDS 10
+#define CONTROL_BUFFER_SIZE 64
+#define PENDING_SIZE (FRAME_HEADER_SIZE + MEMORY_REPLY_SIZE)    // Only control frames are expected, the memory reply is the largest
+#define RESERVED_DESCRIPTORS 8
+#define POLL_INTERVAL_MS 100
+#define MILLISECONDS_PER_SECOND 1000
+#define DECIMAL 10
+
+#ifndef SOCK_CLOEXEC
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wunused-macros"
+    #define SOCK_CLOEXEC 0
+    #pragma GCC diagnostic pop
+#endif
+
+#ifndef SOCK_NONBLOCK
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wunused-macros"
+    #define SOCK_NONBLOCK 0
+    #pragma GCC diagnostic pop
+#endif
+
+typedef struct
+{
+    int     fd;
+    bool    connecting;    // Handshake still in progress, the password goes out once it completes
+    bool    accepted;
+    bool    closed;
+    uint8_t pendingLength;
+    uint8_t pending[PENDING_SIZE];    // Start of a frame whose rest has not arrived yet
+} BenchConnection;
+
+typedef struct
+{
+    BenchConnection *connections;
+    struct pollfd   *pollfds;
+    size_t           count;
+    size_t           accepted;
+    size_t           closed;
+    bool             connectFailed;    // Stop opening more once the server refuses one
+    bool             memoryReported;
+    uint8_t          scratch[FRAME_HEADER_SIZE + MAX_FRAME_CONTENT];
+} Bench;
+
+static bool handleFrame(Bench *bench, BenchConnection *connection, const Packet *packet)
+{
+    /**
+     * React to one frame from the server: answer pings, count logins and print the memory report
+     * Return False if the connection should be dropped
+     */
+    if(isControlFrame(packet->content, packet->contentLength, HEARTBEAT_PING))
+    {
+        char pong[CONTROL_BUFFER_SIZE];
+        int  length = formatPong(pong, sizeof(pong), packet->content, packet->contentLength);
+        return length <= 0 || (size_t)length >= sizeof(pong) || sendFrame(connection->fd, pong, (size_t)length) == 0;
+    }
+
+    if(classifyReply(packet->content, packet->contentLength) == REPLY_ACCEPTED)
+    {
+        connection->accepted = true;
+        bench->accepted++;
+        return true;
+    }
+
+    if(isControlFrame(packet->content, packet->contentLength, MEMORY_REQUEST))
+    {
+        char   reply[MEMORY_REPLY_SIZE];
+        size_t connections;
+        size_t perConnection;
+        size_t buffered;
+        size_t pooled;
+
+        if(packet->contentLength >= sizeof(reply))
+        {
+            return true;
+        }
+        memcpy(reply, packet->content, packet->contentLength);
+        reply[packet->contentLength] = '\0';
+        if(sscanf(reply, MEMORY_REQUEST " %zu %zu %zu %zu", &connections, &perConnection, &buffered, &pooled) == 4)
+        {
+            printf("Server: %zu connections, %zu bytes per connection, %zu bytes buffered, %zu bytes pooled\n", connections, perConnection, buffered, pooled);
+            bench->memoryReported = true;
+        }
+        return true;
+    }
+
+    if(packet->contentLength == strlen(DENIED) && memcmp(packet->content, DENIED, packet->contentLength) == 0)
+    {
+        fprintf(stderr, "Connection %d: password rejected\n", connection->fd);
+        errno = EACCES;
+        return false;
+    }
+    return true;
+}
+
+static void closeBenchConnection(Bench *bench, BenchConnection *connection)
+{
+    close(connection->fd);
+    connection->closed = true;
+    bench->closed++;
+}
+
+static void receiveFrames(Bench *bench, BenchConnection *connection)
+{
+    /**
+     * Read what the server sent and handle every complete frame
+     * Reads land in the shared scratch buffer, only the start of an unfinished frame is kept per connection
+     */
+    size_t  length = connection->pendingLength;
+    size_t  offset = 0;
+    size_t  consumed;
+    ssize_t count;
+    Packet  packet;
+
+    memcpy(bench->scratch, connection->pending, length);
+    count = recv(connection->fd, bench->scratch + length, sizeof(bench->scratch) - length, 0);
+    if(count <= 0)
+    {
+        if(count == -1 && errno == EINTR)
+        {
+            return;
+        }
+        fprintf(stderr, "Connection %d closed by the server\n", connection->fd);
+        closeBenchConnection(bench, connection);
+        return;
+    }
+    length += (size_t)count;
+
+    while((consumed = decodeFrame(bench->scratch + offset, length - offset, &packet)) > 0)
+    {
+        if(!handleFrame(bench, connection, &packet))
+        {
+            perror("Dropping connection");
+            closeBenchConnection(bench, connection);
+            return;
+        }
+        offset += consumed;
+    }
+
+    if(length - offset > sizeof(connection->pending))
+    {
+        fprintf(stderr, "Connection %d: frame larger than %d bytes, closing\n", connection->fd, PENDING_SIZE);
+        closeBenchConnection(bench, connection);
+        return;
+    }
+    memcpy(connection->pending, bench->scratch + offset, length - offset);
+    connection->pendingLength = (uint8_t)(length - offset);
+}
+
+static void finishConnect(Bench *bench, BenchConnection *connection)
+{
+    /**
+     * Complete a nonblocking connect and log in
+     * The socket goes back to blocking mode because pongs are sent with sendFrame
+     */
+    int       error  = 0;
+    socklen_t length = sizeof(error);
+    int       flags;
+
+    connection->connecting = false;
+
+    if(getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1)
+    {
+        error = errno;
+    }
+    if(error == 0)
+    {
+        flags = fcntl(connection->fd, F_GETFL);
+        if(flags == -1 || fcntl(connection->fd, F_SETFL, flags & ~O_NONBLOCK) == -1 || sendFrame(connection->fd, PASSWORD, strlen(PASSWORD)) == -1)
+        {
+            error = errno;
+        }
+    }
+    if(error != 0)
+    {
+        fprintf(stderr, "connect: %s\n", strerror(error));
+        bench->connectFailed = true;
+        closeBenchConnection(bench, connection);
+    }
+}
+
+static void pollConnections(Bench *bench, int timeoutMs)
+{
+    /**
+     * Wait up to timeoutMs for frames from the server and handle whatever arrived
+     */
+    int ready;
+
+    for(size_t i = 0; i < bench->count; i++)
+    {
+        bench->pollfds[i].fd     = bench->connections[i].closed ? -1 : bench->connections[i].fd;
+        bench->pollfds[i].events = bench->connections[i].connecting ? POLLOUT : POLLIN;
+    }
+
+    ready = poll(bench->pollfds, bench->count, timeoutMs);
+    if(ready == -1)
+    {
+        if(errno != EINTR)
+        {
+            perror("Poll failed");
+        }
+        return;
+    }
+
+    for(size_t i = 0; i < bench->count && ready > 0; i++)
+    {
+        if(bench->pollfds[i].revents != 0)
+        {
+            ready--;
+            if(bench->connections[i].connecting)
+            {
+                finishConnect(bench, &bench->connections[i]);
+            }
+            else
+            {
+                receiveFrames(bench, &bench->connections[i]);
+            }
+        }
+    }
+}
+
+static void serviceConnections(Bench *bench, uint64_t untilMs, bool (*done)(const Bench *bench))
+{
+    /**
+     * Answer the server until the deadline passes or done says there is nothing left to wait for
+     */
+    while(monotonicMillis() < untilMs && (done == NULL || !done(bench)))
+    {
+        pollConnections(bench, POLL_INTERVAL_MS);
+    }
+}
+
+static bool allAccepted(const Bench *bench)
+{
+    return bench->accepted + bench->closed >= bench->count;
+}
+
+static bool memoryReported(const Bench *bench)
+{
+    return bench->memoryReported;
+}
+
+static bool startConnect(Bench *bench, const struct sockaddr_in *serverAddress, const SocketTuning *tuning)
+{
+    /**
+     * Start a nonblocking connect so opening connections never stops the bench from answering pings
+     * Return False if no socket could be started
+     */
+    BenchConnection *connection = &bench->connections[bench->count];
+    int              sockfd     = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+
+    if(sockfd == -1)
+    {
+        perror("socket");
+        return false;
+    }
+    applySocketTuning(sockfd, tuning);
+    if(connect(sockfd, (const struct sockaddr *)serverAddress, sizeof(*serverAddress)) == -1 && errno != EINPROGRESS)
+    {
+        perror("connect");
+        close(sockfd);
+        return false;
+    }
+
+    connection->fd         = sockfd;
+    connection->connecting = true;
+    bench->count++;
+    return true;
+}
+
+static size_t openConnections(Bench *bench, const char *address, size_t wanted, const SocketTuning *tuning)
+{
+    /**
+     * Connect and log in wanted times, stopping early at the first failure
+     * Connections already open keep answering pings while the rest are still being opened
+     * tuning: Its backlog should match the server's, it limits how many logins are in flight
+     * Return the number of connections opened
+     */
+    struct sockaddr_in serverAddress;
+    size_t             window;
+
+    // Keep fewer logins in flight than the server's accept queue holds, or the kernel drops SYNs and the handshake waits on retries
+    window = 1;
+    if(tuning->backlog == TUNING_UNSET)
+    {
+        window = SOMAXCONN;
+    }
+    else if(tuning->backlog > 1)
+    {
+        window = (size_t)tuning->backlog - 1;
+    }
+
+    memset(&serverAddress, 0, sizeof(serverAddress));
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port   = htons(PORT);
+    if(inet_pton(AF_INET, address, &serverAddress.sin_addr) != 1)
+    {
+        fprintf(stderr, "Invalid address %s\n", address);
+        return 0;
+    }
+
+    while(bench->count < wanted && !bench->connectFailed)
+    {
+        while(bench->count < wanted && bench->count - bench->accepted - bench->closed < window)
+        {
+            if(!startConnect(bench, &serverAddress, tuning))
+            {
+                return bench->count;
+            }
+        }
+        pollConnections(bench, POLL_INTERVAL_MS);
+    }
+    return bench->count;
+}
+
+static size_t parseCount(const char *value, const char *name)
+{
+    char *endPtr;
+    long  parsed = strtol(value, &endPtr, DECIMAL);
+
+    if(endPtr == value || *endPtr != '\0' || parsed <= 0)
+    {
+        fprintf(stderr, "Invalid %s: %s\n", name, value);
+        exit(EXIT_FAILURE);
+    }
+    return (size_t)parsed;
+}
+
+int main(int argc, char *argv[])
+{
+    /**
+     * Hold many idle, logged in connections open against a server and report what each one costs
+     */
+    const char  *address     = DEFAULT_ADDRESS;
+    size_t       wanted      = DEFAULT_CONNECTIONS;
+    size_t       holdSeconds = DEFAULT_HOLD_SECONDS;
+    SocketTuning tuning;
+    Bench       *bench;
+    uint64_t     soft;
+    uint64_t     hard;
+    uint64_t     startMs;
+    int          option;
+
+    findTuningProfile(TUNING_DEFAULT_PROFILE, &tuning);
+    while((option = getopt(argc, argv, "a:n:d:p:")) != -1)
+    {
+        switch(option)
+        {
+            case 'a':
+                address = optarg;
+                break;
+            case 'n':
+                wanted = parseCount(optarg, "connection count");
+                break;
+            case 'd':
+                holdSeconds = parseCount(optarg, "hold time");
+                break;
+            case 'p':
+                if(!findTuningProfile(optarg, &tuning))
+                {
+                    fprintf(stderr, "Unknown socket profile %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-a server address] [-n connections] [-d seconds to hold them] [-p socket profile]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if(raiseDescriptorLimit(&soft, &hard))
+    {
+        printf("Open file limit %" PRIu64 " (hard %" PRIu64 ")\n", soft, hard);
+        if(soft < wanted + RESERVED_DESCRIPTORS)
+        {
+            wanted = soft > RESERVED_DESCRIPTORS ? (size_t)soft - RESERVED_DESCRIPTORS : 1;
+            printf("Only %zu connections fit, raise the hard limit (ulimit -Hn) for more\n", wanted);
+        }
+    }
+
+    bench = (Bench *)calloc(1, sizeof(*bench));
+    if(bench == NULL || (bench->connections = (BenchConnection *)calloc(wanted, sizeof(BenchConnection))) == NULL || (bench->pollfds = (struct pollfd *)calloc(wanted, sizeof(struct pollfd))) == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    startMs = monotonicMillis();
+    if(openConnections(bench, address, wanted, &tuning) == 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    serviceConnections(bench, monotonicMillis() + ((uint64_t)holdSeconds * MILLISECONDS_PER_SECOND), allAccepted);
+    printf("%zu of %zu connections logged in after %" PRIu64 " ms\n", bench->accepted, bench->count, monotonicMillis() - startMs);
+
+    printf("Holding them idle for %zu s\n", holdSeconds);
+    serviceConnections(bench, monotonicMillis() + ((uint64_t)holdSeconds * MILLISECONDS_PER_SECOND), NULL);
+
+    for(size_t i = 0; i < bench->count; i++)
+    {
+        if(!bench->connections[i].closed && bench->connections[i].accepted)
+        {
+            sendFrame(bench->connections[i].fd, MEMORY_REQUEST, strlen(MEMORY_REQUEST));
+            serviceConnections(bench, monotonicMillis() + MILLISECONDS_PER_SECOND, memoryReported);
+            break;
+        }
+    }
+    if(!bench->memoryReported)
+    {
+        printf("Server did not report its memory use\n");
+    }
+    printf("Bench: %zu connections open, %zu bytes per connection\n", bench->count - bench->closed, sizeof(BenchConnection) + sizeof(struct pollfd));
+
+    for(size_t i = 0; i < bench->count; i++)
+    {
+        if(!bench->connections[i].closed)
+        {
+            close(bench->connections[i].fd);
+        }
+    }
+    free(bench->pollfds);
+    free(bench->connections);
+    free(bench);
+    return EXIT_SUCCESS;
+}
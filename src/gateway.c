@@ -0,0 +1,1198 @@
+#include "link.h"
+#include "protocol.h"
+#include "tuning.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define GATEWAY_PORT 8081
+#define SERVER_PORT 8080
+#define LISTEN_ADDRESS "127.0.0.1"                                  // Operators on this host only unless -a says otherwise
+#define PASSWORD "password"
+#define ACCEPTED "ACCEPTED"
+#define DENIED "DENIED"
+#define NO_SERVERS "NO SERVERS"
+#define FAILED "FAILED"
+#define CONTROL_BUFFER_SIZE 64
+#define NAME_SIZE (INET_ADDRSTRLEN + 6)                             // Address, colon and port
+#define INITIAL_CLIENTS 8
+#define RETRY_MIN_MS 500                                            // First reconnect delay, doubled after every failure
+#define RETRY_MAX_MS 30000
+#define MAX_PORT 65535
+#define DECIMAL 10
+
+#ifndef SOCK_CLOEXEC
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wunused-macros"
+    #define SOCK_CLOEXEC 0
+    #pragma GCC diagnostic pop
+#endif
+
+typedef struct
+{
+    Link               link;             // fd is -1 while disconnected
+    struct sockaddr_in address;
+    char               name[NAME_SIZE];
+    bool               connecting;       // Nonblocking connect still in progress
+    bool               authenticated;
+    uint32_t           retryDelayMs;
+    uint64_t           retryMs;          // When to connect again while disconnected
+    bool               running;          // Last state the server reported
+    bool               stateKnown;
+    uint64_t           stateVersion;
+    Command            inFlight;         // Start or stop sent and not answered yet, COMMAND_OTHER when none
+    int64_t            metrics[METRIC_COUNT];
+    uint64_t           metricSeq;
+    bool               metricsKnown;
+} Upstream;
+
+typedef struct
+{
+    Link          link;
+    bool          authenticated;
+    Command       waiting;          // Start or stop whose fleet-wide answer the client waits for, COMMAND_OTHER when none
+    Subscription *subscription;     // Only allocated while the client wants metrics
+} Client;
+
+typedef struct
+{
+    int            listenfd;
+    Upstream      *upstreams;
+    size_t         upstreamCount;
+    Client       **clients;
+    size_t         clientCount;
+    size_t         clientCapacity;
+    struct pollfd *pollfds;                  // Listening socket, then one slot per server, then the clients
+    uint8_t       *scratch;                  // Every read lands here first, shared because the loop is single threaded
+    const char    *password;                 // Sent to every server and expected from every client
+    uint32_t       heartbeatIntervalMs;
+    uint32_t       heartbeatMaxMisses;
+    uint32_t       metricIntervalMs;         // How often each server pushes its metrics to the gateway
+    SocketTuning   tuning;
+    bool           running;                  // Fleet state published to clients
+    uint64_t       stateVersion;             // Bumped whenever the fleet state changes
+    int64_t        metrics[METRIC_COUNT];    // Fleet totals, shared by every subscribed client
+    bool           metricsFresh;             // Totals already added up during this pass of the event loop
+    bool           acceptPaused;             // Out of descriptors, stop polling the listening socket until one is closed
+} Gateway;
+
+static void gatewayLog(const char *format, ...) __attribute__((format(printf, 1, 2)));
+static void appendText(char *buffer, size_t capacity, size_t *used, const char *format, ...) __attribute__((format(printf, 4, 5)));
+
+static void appendText(char *buffer, size_t capacity, size_t *used, const char *format, ...)
+{
+    /**
+     * Append formatted text, silently stopping at the end of the buffer
+     */
+    va_list args;
+    int     written;
+
+    if(*used >= capacity)
+    {
+        return;
+    }
+    va_start(args, format);
+    written = vsnprintf(buffer + *used, capacity - *used, format, args);
+    va_end(args);
+    if(written > 0)
+    {
+        *used += (size_t)written;
+    }
+    if(*used >= capacity)
+    {
+        *used = capacity - 1;
+    }
+}
+
+static void gatewayLog(const char *format, ...)
+{
+    /**
+     * Print to stdout right away, so nothing is lost when the output is redirected and the gateway is killed
+     */
+    va_list args;
+
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    fflush(stdout);
+}
+
+static void sendString(Link *link, const char *content)
+{
+    linkSendPacket(link, content, strlen(content));
+}
+
+static void sendPing(Link *link, uint64_t nowMs)
+{
+    char ping[CONTROL_BUFFER_SIZE];
+    int  length = formatPing(ping, sizeof(ping), monotonicMicros());
+
+    linkSendPacket(link, ping, (size_t)length);
+    heartbeatOnPing(&link->heartbeat, nowMs);
+}
+
+static bool answerHeartbeat(Link *link, const Packet *packet)
+{
+    /**
+     * Answer a ping or record a pong
+     * Return True if the frame was a heartbeat
+     */
+    uint64_t sentUs;
+
+    if(isControlFrame(packet->content, packet->contentLength, HEARTBEAT_PING))
+    {
+        char pong[CONTROL_BUFFER_SIZE];
+        int  length = formatPong(pong, sizeof(pong), packet->content, packet->contentLength);
+        if(length > 0 && (size_t)length < sizeof(pong))
+        {
+            linkSendPacket(link, pong, (size_t)length);
+        }
+        return true;
+    }
+    if(isControlFrame(packet->content, packet->contentLength, HEARTBEAT_PONG))
+    {
+        if(parsePong(packet->content, packet->contentLength, &sentUs))
+        {
+            heartbeatOnPong(&link->heartbeat, sentUs, monotonicMicros());
+        }
+        return true;
+    }
+    return false;
+}
+
+static void publishState(const Gateway *gateway)
+{
+    /**
+     * Fan the fleet state out to every logged-in client, encoded once
+     */
+    char    content[CONTROL_BUFFER_SIZE];
+    uint8_t frame[FRAME_HEADER_SIZE + CONTROL_BUFFER_SIZE];
+    int     contentLength = formatStateEvent(content, sizeof(content), gateway->stateVersion, gateway->running);
+    size_t  length        = encodeFrame(frame, sizeof(frame), content, (size_t)contentLength);
+    size_t  clients       = 0;
+
+    for(size_t i = 0; i < gateway->clientCount; i++)
+    {
+        Client *client = gateway->clients[i];
+        if(client->authenticated && !client->link.closing)
+        {
+            linkSendEncoded(&client->link, frame, length);
+            clients++;
+        }
+    }
+    gatewayLog("Fleet is %s (version %" PRIu64 "), told %zu clients\n", gateway->running ? STATE_STARTED : STATE_STOPPED, gateway->stateVersion, clients);
+}
+
+static void updateFleetState(Gateway *gateway)
+{
+    /**
+     * Recompute the fleet state from the cache and publish it if it changed
+     * The fleet counts as started only while every connected server reports running
+     */
+    size_t known   = 0;
+    size_t running = 0;
+    bool   fleetRunning;
+
+    for(size_t i = 0; i < gateway->upstreamCount; i++)
+    {
+        const Upstream *upstream = &gateway->upstreams[i];
+        if(upstream->authenticated && upstream->stateKnown)
+        {
+            known++;
+            running += upstream->running ? 1 : 0;
+        }
+    }
+
+    fleetRunning = known > 0 && running == known;
+    if(fleetRunning == gateway->running)
+    {
+        return;
+    }
+    gateway->running = fleetRunning;
+    gateway->stateVersion++;
+    publishState(gateway);
+}
+
+static bool commandInFlight(const Gateway *gateway, Command command)
+{
+    for(size_t i = 0; i < gateway->upstreamCount; i++)
+    {
+        if(gateway->upstreams[i].inFlight == command)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void answerWaitingClients(Gateway *gateway)
+{
+    /**
+     * Answer every client whose start or stop no server is still working on
+     * The answer is the fleet state that resulted, so a server that dropped out mid-command shows up as FAILED
+     */
+    bool startBusy = commandInFlight(gateway, COMMAND_START);
+    bool stopBusy  = commandInFlight(gateway, COMMAND_STOP);
+
+    for(size_t i = 0; i < gateway->clientCount; i++)
+    {
+        Client *client = gateway->clients[i];
+        bool    start  = client->waiting == COMMAND_START;
+
+        if(client->waiting == COMMAND_OTHER || (start ? startBusy : stopBusy))
+        {
+            continue;
+        }
+        if(gateway->running == start)
+        {
+            sendString(&client->link, start ? STATE_STARTED : STATE_STOPPED);
+        }
+        else
+        {
+            sendString(&client->link, FAILED);
+        }
+        client->waiting = COMMAND_OTHER;
+    }
+}
+
+static void fanOutCommand(Gateway *gateway, Client *client, Command command)
+{
+    /**
+     * Send a start or stop to every connected server that still needs it
+     * A server already in the wanted state, or with the same command in flight, is not asked again,
+     * so any number of operators asking at once costs each server a single command
+     */
+    bool        running   = command == COMMAND_START;
+    const char *request   = running ? START_REQUEST : STOP_REQUEST;
+    size_t      connected = 0;
+    size_t      sent      = 0;
+
+    for(size_t i = 0; i < gateway->upstreamCount; i++)
+    {
+        Upstream *upstream = &gateway->upstreams[i];
+
+        if(!upstream->authenticated)
+        {
+            continue;
+        }
+        connected++;
+        if(upstream->inFlight == command || (upstream->inFlight == COMMAND_OTHER && upstream->stateKnown && upstream->running == running))
+        {
+            continue;
+        }
+        sendString(&upstream->link, request);
+        upstream->inFlight = command;
+        sent++;
+    }
+
+    if(connected == 0)
+    {
+        sendString(&client->link, NO_SERVERS);
+        return;
+    }
+    gatewayLog("Client %d: %s sent to %zu of %zu servers, the rest are already there or busy with it\n", client->link.fd, request, sent, connected);
+    client->waiting = command;
+    answerWaitingClients(gateway);
+}
+
+static void refreshMetrics(Gateway *gateway)
+{
+    /**
+     * Add up the cached metrics of every server at most once per pass of the event loop
+     * Uptime and state version take the largest value instead of the sum
+     */
+    if(gateway->metricsFresh)
+    {
+        return;
+    }
+
+    memset(gateway->metrics, 0, sizeof(gateway->metrics));
+    for(size_t i = 0; i < gateway->upstreamCount; i++)
+    {
+        const Upstream *upstream = &gateway->upstreams[i];
+
+        if(!upstream->metricsKnown)
+        {
+            continue;
+        }
+        for(int metric = 0; metric < METRIC_COUNT; metric++)
+        {
+            if(metric == METRIC_UPTIME_SECONDS || metric == METRIC_STATE_VERSION)
+            {
+                if(upstream->metrics[metric] > gateway->metrics[metric])
+                {
+                    gateway->metrics[metric] = upstream->metrics[metric];
+                }
+            }
+            else
+            {
+                gateway->metrics[metric] += upstream->metrics[metric];
+            }
+        }
+    }
+    gateway->metricsFresh = true;
+}
+
+static void subscribe(Client *client, uint64_t mask, uint64_t intervalMs)
+{
+    /**
+     * Start, change or (with an empty mask) end a client's subscription to the fleet totals
+     */
+    Subscription *subscription = client->subscription;
+
+    if((mask & METRIC_ALL) == 0)
+    {
+        free(subscription);
+        client->subscription = NULL;
+        return;
+    }
+
+    if(subscription == NULL)
+    {
+        subscription = (Subscription *)calloc(1, sizeof(*subscription));
+        if(subscription == NULL)
+        {
+            perror("calloc");
+            return;
+        }
+        client->subscription = subscription;
+    }
+    subscriptionConfigure(subscription, (uint32_t)(mask & METRIC_ALL), intervalMs);
+}
+
+static void sendFleetStatus(const Gateway *gateway, Client *client)
+{
+    /**
+     * Describe every server from the cache, no server is contacted
+     * One line per server: address, link, state, smoothed RTT and its latest metrics
+     */
+    char  *status    = (char *)malloc(MAX_FRAME_CONTENT);
+    size_t used      = 0;
+    size_t connected = 0;
+
+    if(status == NULL)
+    {
+        perror("malloc");
+        return;
+    }
+
+    for(size_t i = 0; i < gateway->upstreamCount; i++)
+    {
+        connected += gateway->upstreams[i].authenticated ? 1 : 0;
+    }
+    appendText(status, MAX_FRAME_CONTENT, &used, "%s %zu %zu", FLEET_REQUEST, gateway->upstreamCount, connected);
+
+    for(size_t i = 0; i < gateway->upstreamCount; i++)
+    {
+        const Upstream *upstream = &gateway->upstreams[i];
+        const char     *link     = upstream->authenticated ? "up" : (upstream->link.fd != -1 ? "connecting" : "down");
+        const char     *state    = !upstream->stateKnown ? "unknown" : (upstream->running ? "running" : "stopped");
+
+        appendText(status, MAX_FRAME_CONTENT, &used, "\n%s %s %s version=%" PRIu64 " rtt_us=%" PRIu64, upstream->name, link, state, upstream->stateVersion, upstream->link.heartbeat.rtt.smoothedUs);
+        for(int metric = 0; metric < METRIC_COUNT && upstream->metricsKnown; metric++)
+        {
+            appendText(status, MAX_FRAME_CONTENT, &used, " %s=%" PRId64, metricName((Metric)metric), upstream->metrics[metric]);
+        }
+    }
+
+    linkSendPacket(&client->link, status, used);
+    free(status);
+}
+
+static void handleClientFrame(Gateway *gateway, Client *client, const Packet *packet)
+{
+    /**
+     * Act on one frame from a local manager or script
+     * Reads are answered from the cache, only starts and stops reach the servers
+     */
+    Command command;
+
+    if(packet->version != CURRENT_VERSION || answerHeartbeat(&client->link, packet))
+    {
+        return;
+    }
+
+    command = classifyCommand(packet->content, packet->contentLength);
+    if(command == COMMAND_METRIC_ACK)
+    {
+        uint64_t seq;
+        if(client->subscription != NULL && parseControlNumber(packet->content, packet->contentLength, METRIC_ACK, &seq))
+        {
+            subscriptionOnAck(client->subscription, seq);
+        }
+        return;
+    }
+
+    if(!client->authenticated)
+    {
+        if(packet->contentLength == strlen(gateway->password) && memcmp(packet->content, gateway->password, packet->contentLength) == 0)
+        {
+            char content[CONTROL_BUFFER_SIZE];
+            int  length = formatStateEvent(content, sizeof(content), gateway->stateVersion, gateway->running);
+
+            client->authenticated = true;
+            sendString(&client->link, ACCEPTED);
+            linkSendPacket(&client->link, content, (size_t)length);
+        }
+        else
+        {
+            sendString(&client->link, DENIED);
+        }
+        return;
+    }
+
+    switch(command)
+    {
+        case COMMAND_START:
+        case COMMAND_STOP:
+            fanOutCommand(gateway, client, command);
+            break;
+        case COMMAND_SUBSCRIBE:
+        {
+            uint64_t mask;
+            uint64_t intervalMs;
+            if(parseStreamNumbers(packet->content, packet->contentLength, METRIC_SUBSCRIBE, &mask, &intervalMs))
+            {
+                subscribe(client, mask, intervalMs);
+            }
+            break;
+        }
+        case COMMAND_FLEET:
+            sendFleetStatus(gateway, client);
+            break;
+        case COMMAND_LOG:
+        case COMMAND_TABLE:
+            // Downloads come from one particular server, connect to it directly for those
+            sendString(&client->link, "STREAM UNAVAILABLE");
+            break;
+        case COMMAND_PING:
+        case COMMAND_PONG:
+        case COMMAND_METRIC_ACK:
+            // Control frames are answered above, before the password check
+            break;
+        case COMMAND_MEMORY:    // Each server reports its own memory, the gateway has no table to measure
+        case COMMAND_STREAM_ACK:
+        case COMMAND_STREAM_CANCEL:
+        case COMMAND_OTHER:
+        default:
+            sendString(&client->link, "UNKNOWN COMMAND");
+            break;
+    }
+}
+
+static void storeMetrics(Upstream *upstream, const Packet *packet)
+{
+    /**
+     * Apply a server's metric update to the cache and acknowledge it
+     * A delta built on a snapshot the cache does not hold is dropped, the next keyframe resyncs
+     */
+    MetricUpdate update;
+    char         ack[CONTROL_BUFFER_SIZE];
+    int          length;
+
+    if(!decodeMetricUpdate(packet->content, packet->contentLength, &update) || (update.baseSeq != 0 && (!upstream->metricsKnown || update.baseSeq != upstream->metricSeq)))
+    {
+        return;
+    }
+
+    applyMetricUpdate(&update, upstream->metrics);
+    upstream->metricSeq    = update.seq;
+    upstream->metricsKnown = true;
+
+    length = snprintf(ack, sizeof(ack), METRIC_ACK " %" PRIu64, update.seq);
+    linkSendPacket(&upstream->link, ack, (size_t)length);
+}
+
+static void handleServerFrame(Gateway *gateway, Upstream *upstream, const Packet *packet)
+{
+    /**
+     * Fold one frame from a server into the cache
+     */
+    Reply reply;
+
+    if(packet->version != CURRENT_VERSION || answerHeartbeat(&upstream->link, packet))
+    {
+        return;
+    }
+
+    reply = classifyReply(packet->content, packet->contentLength);
+    switch(reply)
+    {
+        case REPLY_ACCEPTED:
+        {
+            char request[CONTROL_BUFFER_SIZE];
+            int  length = snprintf(request, sizeof(request), METRIC_SUBSCRIBE " %" PRIu32 " %" PRIu32, (uint32_t)METRIC_ALL, gateway->metricIntervalMs);
+
+            upstream->authenticated = true;
+            upstream->retryDelayMs  = RETRY_MIN_MS;
+            linkSendPacket(&upstream->link, request, (size_t)length);
+            gatewayLog("%s: logged in\n", upstream->name);
+            break;
+        }
+        case REPLY_STATE_EVENT:
+        {
+            uint64_t version;
+            bool     running;
+            if(parseStateEvent(packet->content, packet->contentLength, &version, &running) && (!upstream->stateKnown || version > upstream->stateVersion))
+            {
+                upstream->running      = running;
+                upstream->stateVersion = version;
+                upstream->stateKnown   = true;
+                updateFleetState(gateway);
+            }
+            break;
+        }
+        case REPLY_STARTED:
+        case REPLY_STOPPED:
+            // The direct answer already says what the server is doing now, its state event follows
+            upstream->running    = reply == REPLY_STARTED;
+            upstream->stateKnown = true;
+            if(upstream->inFlight == (reply == REPLY_STARTED ? COMMAND_START : COMMAND_STOP))
+            {
+                upstream->inFlight = COMMAND_OTHER;
+            }
+            updateFleetState(gateway);
+            answerWaitingClients(gateway);
+            break;
+        case REPLY_METRICS:
+            storeMetrics(upstream, packet);
+            break;
+        case REPLY_STREAM:
+        case REPLY_HEARTBEAT:    // Answered above
+            break;
+        case REPLY_OTHER:
+        default:
+            if(packet->contentLength == strlen(DENIED) && memcmp(packet->content, DENIED, packet->contentLength) == 0)
+            {
+                gatewayLog("%s: password rejected\n", upstream->name);
+                upstream->link.closing = true;
+            }
+            else
+            {
+                gatewayLog("%s: %.*s\n", upstream->name, (int)packet->contentLength, packet->content);
+            }
+            break;
+    }
+}
+
+static void receiveFromClient(Gateway *gateway, Client *client)
+{
+    /**
+     * Drain the socket and handle every complete frame that arrived
+     */
+    uint8_t *buffer;
+    ssize_t  length;
+
+    while(!client->link.closing && (length = linkRead(&client->link, gateway->scratch, &gateway->tuning, &buffer)) > 0)
+    {
+        size_t offset = 0;
+        size_t consumed;
+        Packet packet;
+
+        while(!client->link.closing && (consumed = decodeFrame(buffer + offset, (size_t)length - offset, &packet)) > 0)
+        {
+            handleClientFrame(gateway, client, &packet);
+            offset += consumed;
+        }
+        linkKeepPartial(&client->link, gateway->scratch, (size_t)length, offset);
+    }
+}
+
+static void receiveFromServer(Gateway *gateway, Upstream *upstream)
+{
+    /**
+     * Drain the socket and fold every complete frame into the cache
+     */
+    uint8_t *buffer;
+    ssize_t  length;
+
+    while(!upstream->link.closing && (length = linkRead(&upstream->link, gateway->scratch, &gateway->tuning, &buffer)) > 0)
+    {
+        size_t offset = 0;
+        size_t consumed;
+        Packet packet;
+
+        while(!upstream->link.closing && (consumed = decodeFrame(buffer + offset, (size_t)length - offset, &packet)) > 0)
+        {
+            handleServerFrame(gateway, upstream, &packet);
+            offset += consumed;
+        }
+        linkKeepPartial(&upstream->link, gateway->scratch, (size_t)length, offset);
+    }
+}
+
+static void connectUpstream(Gateway *gateway, Upstream *upstream, uint64_t nowMs)
+{
+    /**
+     * Start a nonblocking connect, the login follows once the socket becomes writable
+     * The heartbeat deadline also bounds how long the connect may take
+     */
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if(sockfd == -1)
+    {
+        perror("socket");
+        upstream->retryMs = nowMs + upstream->retryDelayMs;
+        return;
+    }
+    applySocketTuning(sockfd, &gateway->tuning);
+
+    upstream->link.fd    = sockfd;
+    upstream->connecting = true;
+    heartbeatInit(&upstream->link.heartbeat, gateway->heartbeatIntervalMs, gateway->heartbeatMaxMisses, nowMs);
+    if(connect(sockfd, (struct sockaddr *)&upstream->address, sizeof(upstream->address)) == -1 && errno != EINPROGRESS)
+    {
+        gatewayLog("%s: connect failed: %s\n", upstream->name, strerror(errno));
+        upstream->link.closing = true;
+    }
+}
+
+static void finishConnect(Gateway *gateway, Upstream *upstream)
+{
+    /**
+     * Check how the nonblocking connect ended and log in if it worked
+     */
+    int       error  = 0;
+    socklen_t length = sizeof(error);
+
+    if(getsockopt(upstream->link.fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0)
+    {
+        gatewayLog("%s: connect failed: %s\n", upstream->name, strerror(error != 0 ? error : errno));
+        upstream->link.closing = true;
+        return;
+    }
+
+    upstream->connecting = false;
+    heartbeatInit(&upstream->link.heartbeat, gateway->heartbeatIntervalMs, gateway->heartbeatMaxMisses, monotonicMillis());
+    sendString(&upstream->link, gateway->password);
+    gatewayLog("%s: connected, logging in\n", upstream->name);
+}
+
+static void disconnectUpstream(Gateway *gateway, Upstream *upstream, uint64_t nowMs)
+{
+    /**
+     * Forget everything cached about a server that went away and back off before reconnecting
+     * Clients waiting on it get their answer from the servers that are left
+     */
+    gatewayLog("%s: %s, trying again in %" PRIu32 " ms\n", upstream->name, upstream->authenticated ? "disconnected" : "not logged in", upstream->retryDelayMs);
+    linkClose(&upstream->link);
+    gateway->acceptPaused = false;
+
+    upstream->connecting    = false;
+    upstream->authenticated = false;
+    upstream->stateKnown    = false;
+    upstream->metricsKnown  = false;
+    upstream->inFlight      = COMMAND_OTHER;
+    upstream->retryMs       = nowMs + upstream->retryDelayMs;
+    upstream->retryDelayMs  = upstream->retryDelayMs * 2 > RETRY_MAX_MS ? RETRY_MAX_MS : upstream->retryDelayMs * 2;
+
+    updateFleetState(gateway);
+    answerWaitingClients(gateway);
+}
+
+static void closeClient(Client *client)
+{
+    linkClose(&client->link);
+    free(client->subscription);
+    free(client);
+}
+
+static void runServerTimers(Gateway *gateway, Upstream *upstream, uint64_t nowMs)
+{
+    /**
+     * Reconnect when the back-off runs out, declare a silent server dead and send due pings
+     */
+    if(upstream->link.fd == -1)
+    {
+        if(nowMs >= upstream->retryMs)
+        {
+            connectUpstream(gateway, upstream, nowMs);
+        }
+        return;
+    }
+
+    if(heartbeatExpired(&upstream->link.heartbeat, nowMs))
+    {
+        gatewayLog("%s: stopped answering\n", upstream->name);
+        upstream->link.closing = true;
+        return;
+    }
+    if(!upstream->connecting && heartbeatPingDue(&upstream->link.heartbeat, nowMs))
+    {
+        sendPing(&upstream->link, nowMs);
+    }
+}
+
+static uint64_t nextServerTimer(const Upstream *upstream)
+{
+    if(upstream->link.fd == -1)
+    {
+        return upstream->retryMs;
+    }
+    return upstream->connecting ? heartbeatDeadline(&upstream->link.heartbeat) : heartbeatNextEvent(&upstream->link.heartbeat);
+}
+
+static void runClientTimers(Gateway *gateway, Client *client, uint64_t nowMs)
+{
+    /**
+     * Declare a silent client dead, send due pings and push the fleet totals it subscribed to
+     */
+    if(heartbeatExpired(&client->link.heartbeat, nowMs))
+    {
+        gatewayLog("Client %d stopped answering, closing\n", client->link.fd);
+        client->link.closing = true;
+        return;
+    }
+    if(heartbeatPingDue(&client->link.heartbeat, nowMs))
+    {
+        sendPing(&client->link, nowMs);
+    }
+
+    if(client->subscription != NULL && subscriptionDue(client->subscription, nowMs))
+    {
+        char   update[METRIC_UPDATE_SIZE];
+        size_t length;
+
+        refreshMetrics(gateway);
+        length = subscriptionUpdate(client->subscription, gateway->metrics, nowMs, update, sizeof(update));
+        if(length > 0)
+        {
+            linkSendPacket(&client->link, update, length);
+        }
+    }
+}
+
+static uint64_t nextClientTimer(const Client *client)
+{
+    uint64_t next = heartbeatNextEvent(&client->link.heartbeat);
+
+    if(client->subscription != NULL && subscriptionNextEvent(client->subscription) < next)
+    {
+        next = subscriptionNextEvent(client->subscription);
+    }
+    return next;
+}
+
+static bool growClients(Gateway *gateway)
+{
+    /**
+     * Double the client table and the poll slots that go with it
+     */
+    size_t         capacity = gateway->clientCapacity == 0 ? INITIAL_CLIENTS : gateway->clientCapacity * 2;
+    Client       **grown    = (Client **)realloc(gateway->clients, capacity * sizeof(*grown));
+    struct pollfd *pollfds;
+
+    if(grown == NULL)
+    {
+        perror("realloc");
+        return false;
+    }
+    gateway->clients = grown;
+
+    pollfds = (struct pollfd *)realloc(gateway->pollfds, (1 + gateway->upstreamCount + capacity) * sizeof(*pollfds));
+    if(pollfds == NULL)
+    {
+        perror("realloc");
+        return false;
+    }
+    gateway->pollfds        = pollfds;
+    gateway->clientCapacity = capacity;
+    return true;
+}
+
+static void acceptClients(Gateway *gateway)
+{
+    /**
+     * Accept every pending client on the listening socket
+     */
+    while(1)
+    {
+        int     newsockfd = accept4(gateway->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        Client *client;
+
+        if(newsockfd == -1)
+        {
+            if(errno == EMFILE || errno == ENFILE)
+            {
+                // The pending client stays queued, polling for it again would only spin
+                gatewayLog("Out of file descriptors at %zu clients, accepting again once one closes\n", gateway->clientCount);
+                gateway->acceptPaused = true;
+            }
+            else if(!wouldBlock(errno) && errno != EINTR)
+            {
+                perror("Accept failed");
+            }
+            return;
+        }
+
+        if(gateway->clientCount == gateway->clientCapacity && !growClients(gateway))
+        {
+            close(newsockfd);
+            return;
+        }
+
+        client = (Client *)calloc(1, sizeof(*client));
+        if(client == NULL)
+        {
+            perror("calloc");
+            close(newsockfd);
+            return;
+        }
+
+        // Not every option is inherited from the listening socket, so each client gets the full profile
+        applySocketTuning(newsockfd, &gateway->tuning);
+        client->link.fd = newsockfd;
+        client->waiting = COMMAND_OTHER;
+        heartbeatInit(&client->link.heartbeat, gateway->heartbeatIntervalMs, gateway->heartbeatMaxMisses, monotonicMillis());
+        gateway->clients[gateway->clientCount++] = client;
+        gatewayLog("Client %d connected\n", newsockfd);
+    }
+}
+
+static void runGateway(Gateway *gateway)
+{
+    /**
+     * Single threaded event loop: the servers, the clients and every timer are serviced from here
+     */
+    while(1)
+    {
+        uint64_t       nowMs   = monotonicMillis();
+        uint64_t       next    = UINT64_MAX;
+        size_t         kept    = 0;
+        struct pollfd *clientfds;
+        int            timeoutMs;
+        int            ready;
+
+        gateway->metricsFresh = false;
+        for(size_t i = 0; i < gateway->upstreamCount; i++)
+        {
+            Upstream *upstream = &gateway->upstreams[i];
+
+            if(!upstream->link.closing)
+            {
+                runServerTimers(gateway, upstream, nowMs);
+            }
+            if(upstream->link.closing)
+            {
+                disconnectUpstream(gateway, upstream, nowMs);
+            }
+            if(nextServerTimer(upstream) < next)
+            {
+                next = nextServerTimer(upstream);
+            }
+        }
+
+        for(size_t i = 0; i < gateway->clientCount; i++)
+        {
+            Client *client = gateway->clients[i];
+            if(!client->link.closing)
+            {
+                runClientTimers(gateway, client, nowMs);
+            }
+            if(client->link.closing)
+            {
+                gatewayLog("Client %d disconnected\n", client->link.fd);
+                closeClient(client);
+                gateway->acceptPaused = false;
+                continue;
+            }
+            if(nextClientTimer(client) < next)
+            {
+                next = nextClientTimer(client);
+            }
+            gateway->clients[kept++] = client;
+        }
+        gateway->clientCount = kept;
+
+        gateway->pollfds[0].fd     = gateway->listenfd;
+        gateway->pollfds[0].events = gateway->acceptPaused ? 0 : POLLIN;
+        for(size_t i = 0; i < gateway->upstreamCount; i++)
+        {
+            const Upstream *upstream = &gateway->upstreams[i];
+
+            gateway->pollfds[i + 1].fd     = upstream->link.fd;
+            gateway->pollfds[i + 1].events = (short)(upstream->connecting ? POLLOUT : (POLLIN | (upstream->link.txLength > 0 ? POLLOUT : 0)));
+        }
+        clientfds = gateway->pollfds + 1 + gateway->upstreamCount;
+        for(size_t i = 0; i < gateway->clientCount; i++)
+        {
+            clientfds[i].fd     = gateway->clients[i]->link.fd;
+            clientfds[i].events = (short)(POLLIN | (gateway->clients[i]->link.txLength > 0 ? POLLOUT : 0));
+        }
+
+        timeoutMs = next == UINT64_MAX ? -1 : (next <= nowMs ? 0 : (int)(next - nowMs));
+        ready     = poll(gateway->pollfds, 1 + gateway->upstreamCount + gateway->clientCount, timeoutMs);
+        if(ready == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            perror("Poll failed");
+            exit(EXIT_FAILURE);
+        }
+
+        for(size_t i = 0; i < gateway->upstreamCount; i++)
+        {
+            Upstream *upstream = &gateway->upstreams[i];
+            short     revents  = gateway->pollfds[i + 1].revents;
+
+            if(upstream->link.fd == -1 || revents == 0)
+            {
+                continue;
+            }
+            if(upstream->connecting)
+            {
+                finishConnect(gateway, upstream);
+                continue;
+            }
+            if(revents & POLLOUT)
+            {
+                linkFlush(&upstream->link);
+            }
+            if(revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                receiveFromServer(gateway, upstream);
+            }
+        }
+
+        for(size_t i = 0; i < gateway->clientCount; i++)
+        {
+            Client *client  = gateway->clients[i];
+            short   revents = clientfds[i].revents;
+
+            if(revents & POLLOUT)
+            {
+                linkFlush(&client->link);
+            }
+            if(revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                receiveFromClient(gateway, client);
+            }
+        }
+
+        if(gateway->pollfds[0].revents & POLLIN)
+        {
+            acceptClients(gateway);
+        }
+    }
+}
+
+static bool parseServer(const char *spec, Upstream *upstream)
+{
+    /**
+     * Parse "address" or "address:port" into a server entry
+     */
+    char        address[INET_ADDRSTRLEN];
+    uint16_t    port          = SERVER_PORT;
+    const char *colon         = strchr(spec, ':');
+    size_t      addressLength = colon != NULL ? (size_t)(colon - spec) : strlen(spec);
+
+    if(addressLength >= sizeof(address))
+    {
+        return false;
+    }
+    memcpy(address, spec, addressLength);
+    address[addressLength] = '\0';
+
+    if(colon != NULL)
+    {
+        char *endPtr;
+        long  value = strtol(colon + 1, &endPtr, DECIMAL);
+
+        if(endPtr == colon + 1 || *endPtr != '\0' || value <= 0 || value > MAX_PORT)
+        {
+            return false;
+        }
+        port = (uint16_t)value;
+    }
+
+    memset(upstream, 0, sizeof(*upstream));
+    upstream->address.sin_family = AF_INET;
+    upstream->address.sin_port   = htons(port);
+    if(inet_pton(AF_INET, address, &upstream->address.sin_addr) != 1)
+    {
+        return false;
+    }
+    snprintf(upstream->name, sizeof(upstream->name), "%s:%u", address, (unsigned int)port);
+    upstream->link.fd      = -1;
+    upstream->retryDelayMs = RETRY_MIN_MS;
+    upstream->inFlight     = COMMAND_OTHER;
+    return true;
+}
+
+static uint32_t parseOption(const char *value, const char *name)
+{
+    char *endPtr;
+    long  parsed = strtol(value, &endPtr, DECIMAL);
+
+    if(endPtr == value || *endPtr != '\0' || parsed <= 0 || parsed > INT32_MAX)
+    {
+        fprintf(stderr, "Invalid %s: %s\n", name, value);
+        exit(EXIT_FAILURE);
+    }
+    return (uint32_t)parsed;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s -s server[:port] [-s server[:port] ...] [-a listen address] [-l listen port] [-w password] [-r metric interval ms] [-i heartbeat interval ms] [-m missed heartbeats before disconnect] [-p socket profile] "
+            "[-c socket tuning file]\n",
+            program);
+}
+
+int main(int argc, char *argv[])
+{
+    /**
+     * Hold one logged-in connection to every server of a fleet and serve any number of local managers from it
+     * -s: A server to manage, repeat for every server in the fleet
+     * -a, -l: Address and port managers connect to
+     * -w: Password the servers expect, clients must send it too
+     * -r: How often the servers push metrics to the gateway
+     */
+    const char        *listenAddress = LISTEN_ADDRESS;
+    uint32_t           listenPort    = GATEWAY_PORT;
+    struct sockaddr_in gatewayAddress;
+    Gateway            gateway;
+    char               description[TUNING_DESCRIPTION_SIZE];
+    int                option;
+    int                sockfd;
+    uint64_t           soft;
+    uint64_t           hard;
+
+    memset(&gateway, 0, sizeof(gateway));
+    gateway.password            = PASSWORD;
+    gateway.heartbeatIntervalMs = HEARTBEAT_INTERVAL_MS;
+    gateway.heartbeatMaxMisses  = HEARTBEAT_MAX_MISSES;
+    gateway.metricIntervalMs    = METRIC_DEFAULT_INTERVAL_MS;
+    findTuningProfile(TUNING_DEFAULT_PROFILE, &gateway.tuning);
+
+    gateway.upstreams = (Upstream *)calloc((size_t)argc, sizeof(*gateway.upstreams));
+    if(gateway.upstreams == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    while((option = getopt(argc, argv, "s:a:l:w:r:i:m:p:c:")) != -1)
+    {
+        switch(option)
+        {
+            case 's':
+                if(!parseServer(optarg, &gateway.upstreams[gateway.upstreamCount]))
+                {
+                    fprintf(stderr, "Invalid server %s, expected address or address:port\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                gateway.upstreamCount++;
+                break;
+            case 'a':
+                listenAddress = optarg;
+                break;
+            case 'l':
+                listenPort = parseOption(optarg, "listen port");
+                break;
+            case 'w':
+                gateway.password = optarg;
+                break;
+            case 'r':
+                gateway.metricIntervalMs = parseOption(optarg, "metric interval");
+                if(gateway.metricIntervalMs < METRIC_MIN_INTERVAL_MS)
+                {
+                    fprintf(stderr, "Invalid metric interval %s, expected at least %d ms\n", optarg, METRIC_MIN_INTERVAL_MS);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'i':
+                gateway.heartbeatIntervalMs = parseOption(optarg, "heartbeat interval");
+                break;
+            case 'm':
+                gateway.heartbeatMaxMisses = parseOption(optarg, "heartbeat miss count");
+                break;
+            case 'p':
+                if(!findTuningProfile(optarg, &gateway.tuning))
+                {
+                    listTuningProfiles(description, sizeof(description));
+                    fprintf(stderr, "Unknown socket profile %s, expected one of: %s\n", optarg, description);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                if(!loadTuningFile(optarg, &gateway.tuning))
+                {
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if(gateway.upstreamCount == 0 || listenPort > MAX_PORT)
+    {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // A manager or server vanishing mid-write must not kill the gateway
+    signal(SIGPIPE, SIG_IGN);
+
+    if(raiseDescriptorLimit(&soft, &hard))
+    {
+        gatewayLog("Open file limit %" PRIu64 " (hard %" PRIu64 ")\n", soft, hard);
+    }
+
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(sockfd == -1)
+    {
+        perror("Socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+    applySocketTuning(sockfd, &gateway.tuning);
+
+    memset(&gatewayAddress, 0, sizeof(gatewayAddress));
+    gatewayAddress.sin_family = AF_INET;
+    gatewayAddress.sin_port   = htons((uint16_t)listenPort);
+    if(inet_pton(AF_INET, listenAddress, &gatewayAddress.sin_addr) != 1)
+    {
+        fprintf(stderr, "Invalid listen address %s\n", listenAddress);
+        exit(EXIT_FAILURE);
+    }
+    if(bind(sockfd, (struct sockaddr *)&gatewayAddress, sizeof(gatewayAddress)) == -1)
+    {
+        perror("Bind failed");
+        exit(EXIT_FAILURE);
+    }
+    if(listen(sockfd, gateway.tuning.backlog == TUNING_UNSET ? SOMAXCONN : gateway.tuning.backlog) == -1)
+    {
+        perror("Listen failed");
+        exit(EXIT_FAILURE);
+    }
+
+    gateway.listenfd = sockfd;
+    gateway.scratch  = (uint8_t *)malloc(LINK_BUFFER_SIZE);
+    if(gateway.scratch == NULL || !growClients(&gateway))
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    gatewayLog("Gateway listening on %s:%" PRIu32 " for a fleet of %zu servers\n", listenAddress, listenPort, gateway.upstreamCount);
+    describeSocketTuning(sockfd, &gateway.tuning, description, sizeof(description));
+    gatewayLog("Socket tuning %s\n", description);
+
+    runGateway(&gateway);
+
+    close(sockfd);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,336 @@
+#include "link.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+    #define MSG_NOSIGNAL 0
+#endif
+
+typedef struct PooledBuffer
+{
+    struct PooledBuffer *next;
+} PooledBuffer;
+
+typedef struct
+{
+    PooledBuffer *free;    // Drained LINK_BUFFER_SIZE buffers waiting to be reused
+    size_t        count;
+} BufferPool;
+
+static BufferPool bufferPool;    // Shared by every link's read and write buffers, the event loops are single threaded
+
+static uint8_t *acquireBuffer(void)
+{
+    /**
+     * Take a LINK_BUFFER_SIZE buffer from the pool, or from the heap when the pool is empty
+     * Return NULL if memory ran out
+     */
+    PooledBuffer *buffer = bufferPool.free;
+
+    if(buffer == NULL)
+    {
+        return (uint8_t *)malloc(LINK_BUFFER_SIZE);
+    }
+    bufferPool.free = buffer->next;
+    bufferPool.count--;
+    return (uint8_t *)buffer;
+}
+
+static void releaseBuffer(uint8_t *buffer, size_t capacity)
+{
+    /**
+     * Hand a drained buffer back to the pool, buffers that grew past LINK_BUFFER_SIZE or overflow the pool are freed
+     */
+    PooledBuffer *pooled = (PooledBuffer *)(void *)buffer;
+
+    if(buffer == NULL)
+    {
+        return;
+    }
+    if(capacity != LINK_BUFFER_SIZE || bufferPool.count >= LINK_MAX_POOLED_BUFFERS)
+    {
+        free(buffer);
+        return;
+    }
+    pooled->next    = bufferPool.free;
+    bufferPool.free = pooled;
+    bufferPool.count++;
+}
+
+static void sendFailed(Link *link)
+{
+    /**
+     * Drop the peer unless the send only failed because the socket buffer is full
+     */
+    if(!wouldBlock(errno))
+    {
+        perror("Send failed");
+        link->closing = true;
+    }
+}
+
+static bool reserveOutput(Link *link, size_t length)
+{
+    /**
+     * Make room for length more bytes of pending output, taking a pooled buffer first
+     * The buffer doubles as it grows so a slow reader costs few reallocations
+     * Return False (and drop the peer) if it stopped reading or memory ran out
+     */
+    size_t   needed = link->txLength + length;
+    size_t   capacity;
+    uint8_t *grown;
+
+    if(needed <= link->txCapacity)
+    {
+        return true;
+    }
+    if(needed > LINK_MAX_PENDING_OUTPUT)
+    {
+        fprintf(stderr, "Peer %d is not reading its frames, closing\n", link->fd);
+        link->closing = true;
+        return false;
+    }
+
+    if(link->txBuffer == NULL && needed <= LINK_BUFFER_SIZE)
+    {
+        link->txBuffer = acquireBuffer();
+        if(link->txBuffer == NULL)
+        {
+            perror("malloc");
+            link->closing = true;
+            return false;
+        }
+        link->txCapacity = LINK_BUFFER_SIZE;
+        return true;
+    }
+
+    capacity = link->txCapacity < LINK_BUFFER_SIZE ? LINK_BUFFER_SIZE : link->txCapacity;
+    while(capacity < needed)
+    {
+        capacity *= 2;
+    }
+    if(capacity > LINK_MAX_PENDING_OUTPUT)
+    {
+        capacity = LINK_MAX_PENDING_OUTPUT;
+    }
+
+    grown = (uint8_t *)realloc(link->txBuffer, capacity);
+    if(grown == NULL)
+    {
+        perror("realloc");
+        link->closing = true;
+        return false;
+    }
+    link->txBuffer   = grown;
+    link->txCapacity = capacity;
+    return true;
+}
+
+void linkSend(Link *link, struct iovec *parts, int count)
+{
+    /**
+     * Send frame bytes straight from the caller's memory when nothing is queued or held ahead of them
+     * Only what the socket does not take right away is copied into the link's output buffer
+     */
+    struct msghdr message;
+    size_t        sent = 0;
+
+    if(link->closing)
+    {
+        return;
+    }
+
+    if(link->txLength == 0 && !link->held)
+    {
+        ssize_t result;
+
+        memset(&message, 0, sizeof(message));
+        message.msg_iov    = parts;
+        message.msg_iovlen = (size_t)count;
+        do
+        {
+            result = sendmsg(link->fd, &message, MSG_NOSIGNAL);
+        } while(result == -1 && errno == EINTR);
+
+        if(result == -1)
+        {
+            sendFailed(link);
+        }
+        else
+        {
+            sent = (size_t)result;
+        }
+    }
+
+    for(int i = 0; i < count && !link->closing; i++)
+    {
+        size_t skipped = sent < parts[i].iov_len ? sent : parts[i].iov_len;
+        size_t left    = parts[i].iov_len - skipped;
+
+        sent -= skipped;
+        if(left > 0 && reserveOutput(link, left))
+        {
+            memcpy(link->txBuffer + link->txLength, (const uint8_t *)parts[i].iov_base + skipped, left);
+            link->txLength += left;
+        }
+    }
+}
+
+void linkSendPacket(Link *link, const char *content, size_t length)
+{
+    /**
+     * Frame content and send it, queueing whatever the socket cannot take yet
+     */
+    uint8_t      header[FRAME_HEADER_SIZE];
+    struct iovec parts[2];
+
+    encodeFrameHeader(header, length);
+    parts[0].iov_base = header;
+    parts[0].iov_len  = sizeof(header);
+    parts[1].iov_base = (void *)(uintptr_t)content;
+    parts[1].iov_len  = length;
+    linkSend(link, parts, 2);
+}
+
+void linkSendEncoded(Link *link, const uint8_t *frame, size_t length)
+{
+    /**
+     * Send a frame that is already encoded, so one frame can be shared by every peer
+     */
+    struct iovec part;
+
+    part.iov_base = (void *)(uintptr_t)frame;
+    part.iov_len  = length;
+    linkSend(link, &part, 1);
+}
+
+void linkFlush(Link *link)
+{
+    /**
+     * Write as much of the pending output as the socket accepts without blocking
+     * The output buffer goes back to the pool as soon as it drains
+     */
+    size_t offset = 0;
+
+    while(offset < link->txLength)
+    {
+        ssize_t sent = send(link->fd, link->txBuffer + offset, link->txLength - offset, MSG_NOSIGNAL);
+        if(sent == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            sendFailed(link);
+            break;
+        }
+        offset += (size_t)sent;
+    }
+
+    link->txLength -= offset;
+    if(link->txLength > 0)
+    {
+        memmove(link->txBuffer, link->txBuffer + offset, link->txLength);
+    }
+    else
+    {
+        releaseBuffer(link->txBuffer, link->txCapacity);
+        link->txBuffer   = NULL;
+        link->txCapacity = 0;
+    }
+}
+
+ssize_t linkRead(Link *link, uint8_t *scratch, const SocketTuning *tuning, uint8_t **buffer)
+{
+    /**
+     * Read whatever the socket has, after the partial frame already held
+     * scratch: LINK_BUFFER_SIZE bytes the read lands in when no partial frame is held
+     * Return the bytes now waiting at *buffer, 0 if the peer closed the connection, -1 once there is nothing more to read
+     * The link is marked closing when the peer went away
+     */
+    ssize_t count;
+
+    *buffer = link->rxBuffer != NULL ? link->rxBuffer : scratch;
+    do
+    {
+        count = recv(link->fd, *buffer + link->rxLength, LINK_BUFFER_SIZE - link->rxLength, 0);
+    } while(count == -1 && errno == EINTR);
+
+    if(count == 0)
+    {
+        link->closing = true;
+        return 0;
+    }
+    if(count == -1)
+    {
+        if(!wouldBlock(errno))
+        {
+            perror("Receive failed");
+            link->closing = true;
+        }
+        return -1;
+    }
+
+    rearmQuickAck(link->fd, tuning);
+    heartbeatOnReceive(&link->heartbeat, monotonicMillis());
+    return (ssize_t)(link->rxLength + (size_t)count);
+}
+
+void linkKeepPartial(Link *link, const uint8_t *scratch, size_t length, size_t offset)
+{
+    /**
+     * Hold on to the start of an incomplete frame once the complete ones before offset are handled
+     * A link only takes a buffer of its own while something is left over
+     */
+    length -= offset;
+    if(length == 0)
+    {
+        releaseBuffer(link->rxBuffer, LINK_BUFFER_SIZE);
+        link->rxBuffer = NULL;
+    }
+    else if(link->rxBuffer == NULL)
+    {
+        link->rxBuffer = acquireBuffer();
+        if(link->rxBuffer == NULL)
+        {
+            perror("malloc");
+            link->closing = true;
+            return;
+        }
+        memcpy(link->rxBuffer, scratch + offset, length);
+    }
+    else
+    {
+        memmove(link->rxBuffer, link->rxBuffer + offset, length);
+    }
+    link->rxLength = length;
+}
+
+void linkClose(Link *link)
+{
+    /**
+     * Close the socket and return its buffers, leaving the link ready to be reused
+     */
+    if(link->fd != -1)
+    {
+        close(link->fd);
+    }
+    releaseBuffer(link->rxBuffer, LINK_BUFFER_SIZE);
+    releaseBuffer(link->txBuffer, link->txCapacity);
+    memset(link, 0, sizeof(*link));
+    link->fd = -1;
+}
+
+size_t linkBufferedBytes(const Link *link)
+{
+    return (link->rxBuffer != NULL ? LINK_BUFFER_SIZE : 0) + link->txCapacity;
+}
+
+size_t linkPooledBytes(void)
+{
+    return bufferPool.count * (size_t)LINK_BUFFER_SIZE;
+}
@@ -1,7 +1,12 @@
+#include "protocol.h"
+#include "tuning.h"
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <ncurses.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -11,12 +16,14 @@
 #include <unistd.h>
 
 #define MAX_MESSAGE_LENGTH 1024    // Buffer length
-#define CURRENT_VERSION 1          // Current version of the protocol
 #define BUFFER_SIZE 100            // Buffer size
 #define ASCII_BACKSPACE 127        // ASCII value for backspace
 #define ASCII_DELETE 8             // ASCII value for delete
 #define DECIMAL 10                 // Decimal base
 #define MAX_PORT 65535             // Maximum port number
+#define CONTROL_BUFFER_SIZE 64     // Ping and pong frames
+#define DISCONNECTED "DISCONNECTED"
+#define FILE_MODE 0644             // Permissions of downloaded files
 
 #define RESTRICTED_PORTS                                                                                                                                                                                                                                           \
     {                                                                                                                                                                                                                                                              \
@@ -40,12 +47,15 @@ typedef struct
     int   portNumber;
 } ServerInfo;
 
-typedef struct
+struct Download
 {
-    uint8_t  version;
-    uint16_t contentLength;
-    char    *content;
-} Packet;
+    int      fd;    // Destination file, -1 when no download is running
+    char    *path;
+    uint32_t id;
+    uint64_t total;
+    uint64_t received;
+    uint32_t chunks;
+};
 
 struct SharedData
 {
@@ -54,29 +64,54 @@ struct SharedData
     int             newDataFlag;
     char            newData[MAX_MESSAGE_LENGTH];    // Adjust buffer size as needed
     bool            running;
+    bool            connected;    // Cleared once the server closes or misses too many heartbeats
+    Heartbeat       heartbeat;    // Owned by the listening thread, read by the menu under mutex
+    struct Download download;     // Started by the menu, written to disk by the listening thread
+    bool            serverRunning;    // Last state published by the server, never guessed locally
+    bool            stateKnown;
+    uint64_t        stateVersion;
+    int64_t         metrics[METRIC_COUNT];    // Server metrics rebuilt from keyframes and deltas
+    uint64_t        metricSeq;                // Update the metrics reflect, acknowledged to the server
+    bool            metricsKnown;             // Deltas are useless until the first keyframe arrives
 };
 
 struct ThreadArgs
 {
-    int                sockfd;
-    struct SharedData *sharedData;
+    int                 sockfd;
+    struct SharedData  *sharedData;
+    const SocketTuning *tuning;
 };
 
 bool       checkIPAddress(char *ipAddress);
 bool       verifyMessageFormat(Packet packet);
 bool       isRestrictedPort(long port);
+bool       isHeartbeat(Packet packet);
+bool       isServerRunning(struct SharedData *sharedData);
+void       applyStateEvent(struct SharedData *sharedData, Packet packet);
 char      *getInput(void);
 void       printMenu(void);
 void       sendToServer(int sockfd, const char *message);
+void       sendControl(int sockfd, const char *content, size_t length);
+void       printRtt(const RttStats *rtt);
+void       printLinkStatus(struct SharedData *sharedData);
+void       markDisconnected(struct SharedData *sharedData, const char *reason);
+void       handleStreamFrame(int sockfd, struct SharedData *sharedData, Packet packet);
+void       handleMetricUpdate(int sockfd, struct SharedData *sharedData, Packet packet);
+void       finishDownload(struct Download *download);
+void       requestDownload(int sockfd, struct SharedData *sharedData, const char *request, const char *defaultPath);
 void      *listenToServer(void *arg);
-int        connectToServer(char *ipAddress, int portNumber);
-Packet     receiveFromServer(int sockfd);
-ServerInfo getSocketInformation(void);
+int        connectToServer(char *ipAddress, int portNumber, const SocketTuning *tuning);
+bool       receiveFromServer(int sockfd, int timeoutMs, Packet *packet);
+void       getSocketInformation(ServerInfo *serverInfo);
+uint32_t   parseHeartbeatOption(const char *value);
+uint32_t   parseMetricInterval(const char *value);
+void       subscribeToMetrics(int sockfd, uint32_t mask, uint32_t intervalMs);
 
 void *listenToServer(void *arg)
 {
     /**
      * Listen to the server for any incoming messages
+     * Also drives the heartbeat: pings the server on schedule and declares it dead when it goes quiet
      */
 
     struct ThreadArgs *args       = (struct ThreadArgs *)arg;
@@ -85,48 +120,388 @@ void *listenToServer(void *arg)
 
     while(sharedData->running)
     {
-        Packet packet = receiveFromServer(sockfd);
-        if(packet.version == 0)
+        Packet   packet;
+        uint64_t nowMs;
+        uint64_t nextMs;
+        uint64_t deadlineMs;
+        bool     expired;
+        bool     pingDue;
+        int      ready;
+        struct pollfd pfd;
+
+        pthread_mutex_lock(&sharedData->mutex);
+        nowMs      = monotonicMillis();
+        expired    = heartbeatExpired(&sharedData->heartbeat, nowMs);
+        pingDue    = heartbeatPingDue(&sharedData->heartbeat, nowMs);
+        deadlineMs = heartbeatDeadline(&sharedData->heartbeat);
+        if(pingDue)
+        {
+            heartbeatOnPing(&sharedData->heartbeat, nowMs);
+        }
+        nextMs = heartbeatNextEvent(&sharedData->heartbeat);
+        pthread_mutex_unlock(&sharedData->mutex);
+
+        if(expired)
+        {
+            markDisconnected(sharedData, "Server stopped answering heartbeats");
+            break;
+        }
+
+        if(pingDue)
+        {
+            char ping[CONTROL_BUFFER_SIZE];
+            int  length = formatPing(ping, sizeof(ping), monotonicMicros());
+            sendControl(sockfd, ping, (size_t)length);
+        }
+
+        pfd.fd     = sockfd;
+        pfd.events = POLLIN;
+        ready      = poll(&pfd, 1, nextMs > nowMs ? (int)(nextMs - nowMs) : 0);
+        if(ready <= 0)
+        {
+            continue;
+        }
+
+        // A peer that dies halfway through a frame is still caught by the heartbeat deadline
+        nowMs  = monotonicMillis();
+        if(!receiveFromServer(sockfd, deadlineMs > nowMs ? (int)(deadlineMs - nowMs) : 0, &packet))
         {
-            printw("Thread function: exiting.\n");
+            markDisconnected(sharedData, "Connection to server closed");
             break;
         }
+        rearmQuickAck(sockfd, args->tuning);
+
+        if(isControlFrame(packet.content, packet.contentLength, HEARTBEAT_PING))
+        {
+            char pong[CONTROL_BUFFER_SIZE];
+            int  length = formatPong(pong, sizeof(pong), packet.content, packet.contentLength);
+            if(length > 0 && (size_t)length < sizeof(pong))
+            {
+                sendControl(sockfd, pong, (size_t)length);
+            }
+        }
+
         pthread_mutex_lock(&sharedData->mutex);
-        strncpy(sharedData->newData, packet.content, sizeof(sharedData->newData));
+        heartbeatOnReceive(&sharedData->heartbeat, monotonicMillis());
 
-        if((strcmp(packet.content, "STOPPED") == 0 || strcmp(packet.content, "STOPPED\n") == 0))
+        switch(classifyReply(packet.content, packet.contentLength))
         {
-            printw("Thread function: Server stopped\n");
-            sharedData->newDataFlag = 1;                  // Set the flag to indicate new data
-            pthread_cond_signal(&sharedData->condVar);    // Signal the condition variable
+            case REPLY_HEARTBEAT:
+            {
+                uint64_t sentUs;
+                if(parsePong(packet.content, packet.contentLength, &sentUs))
+                {
+                    heartbeatOnPong(&sharedData->heartbeat, sentUs, monotonicMicros());
+                }
+                break;
+            }
+            case REPLY_STATE_EVENT:
+                applyStateEvent(sharedData, packet);
+                break;
+            case REPLY_STREAM:
+                handleStreamFrame(sockfd, sharedData, packet);
+                break;
+            case REPLY_STOPPED:
+                strncpy(sharedData->newData, packet.content, sizeof(sharedData->newData));
+                printw("Thread function: Server stopped\n");
+                sharedData->newDataFlag = 1;                  // Set the flag to indicate new data
+                pthread_cond_signal(&sharedData->condVar);    // Signal the condition variable
+                break;
+            case REPLY_STARTED:
+                strncpy(sharedData->newData, packet.content, sizeof(sharedData->newData));
+                printw("Thread function: Server started\n");
+                sharedData->newDataFlag = 1;                  // Set the flag to indicate new data
+                pthread_cond_signal(&sharedData->condVar);    // Signal the condition variable
+                break;
+            case REPLY_ACCEPTED:
+                strncpy(sharedData->newData, packet.content, sizeof(sharedData->newData));
+                printw("Thread function: Password accepted\n");
+                sharedData->newDataFlag = 1;                  // Set the flag to indicate new data
+                pthread_cond_signal(&sharedData->condVar);    // Signal the condition variable
+                break;
+            case REPLY_METRICS:
+                handleMetricUpdate(sockfd, sharedData, packet);
+                break;
+            case REPLY_OTHER:
+            default:
+                strncpy(sharedData->newData, packet.content, sizeof(sharedData->newData));
+                printw("Thread function: From server: %s\n", packet.content);
+                sharedData->newDataFlag = 1;                  // Set the flag to indicate new data
+                pthread_cond_signal(&sharedData->condVar);    // Signal the condition variable
+                break;
         }
-        else if((strcmp(packet.content, "STARTED") == 0 || strcmp(packet.content, "STARTED\n") == 0))
+        pthread_mutex_unlock(&sharedData->mutex);
+        free(packet.content);
+    }
+    printw("Thread function: exiting.\n");
+    refresh();
+    return NULL;
+}
+
+void markDisconnected(struct SharedData *sharedData, const char *reason)
+{
+    /**
+     * Record that the server is gone and wake the menu if it is waiting on a reply
+     * reason: Why the connection was dropped
+     */
+    pthread_mutex_lock(&sharedData->mutex);
+    if(sharedData->running)
+    {
+        printw("\nThread function: %s.\n", reason);
+    }
+    sharedData->connected = false;
+    strncpy(sharedData->newData, DISCONNECTED, sizeof(sharedData->newData));
+    sharedData->newDataFlag = 1;
+    pthread_cond_signal(&sharedData->condVar);
+    pthread_mutex_unlock(&sharedData->mutex);
+}
+
+void applyStateEvent(struct SharedData *sharedData, Packet packet)
+{
+    /**
+     * Adopt the state the server published, ignoring events older than the one already applied
+     * Called by the listening thread with the mutex held
+     */
+    uint64_t version;
+    bool     running;
+
+    if(!parseStateEvent(packet.content, packet.contentLength, &version, &running) || (sharedData->stateKnown && version <= sharedData->stateVersion))
+    {
+        return;
+    }
+
+    sharedData->serverRunning = running;
+    sharedData->stateVersion  = version;
+    sharedData->stateKnown    = true;
+    printw("Thread function: Server is %s (state version %" PRIu64 ")\n", running ? "running" : "stopped", version);
+    refresh();
+}
+
+bool isServerRunning(struct SharedData *sharedData)
+{
+    /**
+     * Read the server state last published by the server
+     */
+    bool running;
+
+    pthread_mutex_lock(&sharedData->mutex);
+    running = sharedData->serverRunning;
+    pthread_mutex_unlock(&sharedData->mutex);
+    return running;
+}
+
+void handleMetricUpdate(int sockfd, struct SharedData *sharedData, Packet packet)
+{
+    /**
+     * Apply a metric update and acknowledge it so the server takes its next delta against it
+     * A delta built on a snapshot this side does not have is dropped, the next keyframe resyncs
+     * Called by the listening thread with the mutex held
+     */
+    MetricUpdate update;
+    char         ack[CONTROL_BUFFER_SIZE];
+    int          ackLength;
+
+    if(!decodeMetricUpdate(packet.content, packet.contentLength, &update))
+    {
+        printw("Thread function: Malformed metric update ignored\n");
+        return;
+    }
+    if(update.baseSeq != 0 && (!sharedData->metricsKnown || update.baseSeq != sharedData->metricSeq))
+    {
+        return;
+    }
+
+    applyMetricUpdate(&update, sharedData->metrics);
+    sharedData->metricSeq    = update.seq;
+    sharedData->metricsKnown = true;
+
+    ackLength = snprintf(ack, sizeof(ack), METRIC_ACK " %" PRIu64, update.seq);
+    sendControl(sockfd, ack, (size_t)ackLength);
+
+    printw("----- Metrics%s:", update.baseSeq == 0 ? " (keyframe)" : "");
+    for(int metric = 0; metric < METRIC_COUNT; metric++)
+    {
+        if(update.mask & (1U << metric))
         {
-            printw("Thread function: Server started\n");
-            sharedData->newDataFlag = 1;                  // Set the flag to indicate new data
-            pthread_cond_signal(&sharedData->condVar);    // Signal the condition variable
+            printw(" %s=%" PRId64, metricName((Metric)metric), sharedData->metrics[metric]);
         }
-        else if((strcmp(packet.content, "ACCEPTED") == 0) || (strcmp(packet.content, "ACCEPTED\n") == 0))
+    }
+    printw(" | RTT ");
+    printRtt(&sharedData->heartbeat.rtt);
+    printw(" -----\n\n");
+    refresh();
+    printMenu();
+}
+
+void handleStreamFrame(int sockfd, struct SharedData *sharedData, Packet packet)
+{
+    /**
+     * Write a streamed download to disk as it arrives, one chunk at a time
+     * Every chunk is acknowledged once it is on disk, which reopens the server's send window
+     * Called by the listening thread with the mutex held
+     */
+    struct Download *download = &sharedData->download;
+    uint64_t         id;
+    uint64_t         value;
+
+    if(download->fd == -1)
+    {
+        return;
+    }
+
+    if(isControlFrame(packet.content, packet.contentLength, STREAM_BEGIN) && parseStreamNumbers(packet.content, packet.contentLength, STREAM_BEGIN, &id, &value))
+    {
+        download->id       = (uint32_t)id;
+        download->total    = value;
+        download->received = 0;
+        download->chunks   = 0;
+        printw("Thread function: Receiving %" PRIu64 " bytes into %s\n", value, download->path);
+    }
+    else if(isControlFrame(packet.content, packet.contentLength, STREAM_CHUNK))
+    {
+        uint32_t    chunkId;
+        uint32_t    seq;
+        const char *data;
+        size_t      length;
+        char        ack[CONTROL_BUFFER_SIZE];
+        int         ackLength;
+
+        if(!parseChunk(packet.content, packet.contentLength, &chunkId, &seq, &data, &length) || chunkId != download->id)
         {
-            printw("Thread function: Password accepted\n");
-            sharedData->newDataFlag = 1;                  // Set the flag to indicate new data
-            pthread_cond_signal(&sharedData->condVar);    // Signal the condition variable
+            return;
         }
-        else if((strstr(packet.content, "/d") != NULL))
+        while(length > 0)
         {
-            printw("----- Diagnosic: %s -----\n\n", packet.content);
-            refresh();
-            printMenu();
+            ssize_t written = write(download->fd, data, length);
+            if(written == -1)
+            {
+                // Without a cancel the server would wait on the acks forever and refuse the next download
+                ackLength = snprintf(ack, sizeof(ack), "%s %" PRIu32, STREAM_CANCEL, chunkId);
+                sendControl(sockfd, ack, (size_t)ackLength);
+                printw("Thread function: Writing %s failed, download abandoned\n", download->path);
+                finishDownload(download);
+                return;
+            }
+            data += written;
+            length -= (size_t)written;
+            download->received += (uint64_t)written;
         }
-        else
+        download->chunks++;
+        ackLength = snprintf(ack, sizeof(ack), "%s %" PRIu32 " %" PRIu32, STREAM_ACK, chunkId, download->chunks);
+        sendControl(sockfd, ack, (size_t)ackLength);
+    }
+    else if(isControlFrame(packet.content, packet.contentLength, STREAM_END) && parseStreamNumbers(packet.content, packet.contentLength, STREAM_END, &id, &value) && id == download->id)
+    {
+        printw("----- Saved %" PRIu64 " of %" PRIu64 " bytes to %s -----\n\n", download->received, download->total, download->path);
+        finishDownload(download);
+        printMenu();
+    }
+    else if(isControlFrame(packet.content, packet.contentLength, STREAM_REPLY))
+    {
+        printw("----- Download refused: %s -----\n\n", packet.content);
+        finishDownload(download);
+        printMenu();
+    }
+}
+
+void finishDownload(struct Download *download)
+{
+    /**
+     * Close the destination file and make room for the next download
+     */
+    close(download->fd);
+    free(download->path);
+    download->fd   = -1;
+    download->path = NULL;
+}
+
+void requestDownload(int sockfd, struct SharedData *sharedData, const char *request, const char *defaultPath)
+{
+    /**
+     * Ask the server to stream a dump and save it to a file chosen by the user
+     * The download continues in the background while the menu stays usable
+     */
+    char *path;
+    int   fd;
+
+    printw("\nSave to file [%s]: ", defaultPath);
+    path = getInput();
+    if(path[0] == '\0')
+    {
+        free(path);
+        path = strdup(defaultPath);
+        if(path == NULL)
         {
-            printw("Thread function: From server: %s\n", packet.content);
-            sharedData->newDataFlag = 1;                  // Set the flag to indicate new data
-            pthread_cond_signal(&sharedData->condVar);    // Signal the condition variable
+            perror("strdup");
+            exit(EXIT_FAILURE);
         }
+    }
+
+    pthread_mutex_lock(&sharedData->mutex);
+    if(sharedData->download.fd != -1)
+    {
+        printw("\nA download is already in progress.\n");
         pthread_mutex_unlock(&sharedData->mutex);
+        free(path);
+        return;
     }
-    pthread_exit(NULL);
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, FILE_MODE);
+    if(fd == -1)
+    {
+        printw("\nCould not open %s for writing.\n", path);
+        pthread_mutex_unlock(&sharedData->mutex);
+        free(path);
+        return;
+    }
+
+    sharedData->download.fd   = fd;
+    sharedData->download.path = path;
+    sharedData->download.id   = 0;
+    pthread_mutex_unlock(&sharedData->mutex);
+
+    sendToServer(sockfd, request);
+}
+
+bool isHeartbeat(Packet packet)
+{
+    /**
+     * Check if the packet is a ping or pong that the user never needs to see
+     */
+    return isControlFrame(packet.content, packet.contentLength, HEARTBEAT_PING) || isControlFrame(packet.content, packet.contentLength, HEARTBEAT_PONG);
+}
+
+void printRtt(const RttStats *rtt)
+{
+    /**
+     * Print the smoothed round trip time in milliseconds
+     */
+    if(rtt->samples == 0)
+    {
+        printw("n/a");
+        return;
+    }
+    printw("%" PRIu64 ".%03" PRIu64 " ms", rtt->smoothedUs / MICROSECONDS_PER_MILLISECOND, rtt->smoothedUs % MICROSECONDS_PER_MILLISECOND);
+}
+
+void printLinkStatus(struct SharedData *sharedData)
+{
+    /**
+     * Print the live link quality measured by the heartbeat
+     */
+    const RttStats *rtt = &sharedData->heartbeat.rtt;
+
+    pthread_mutex_lock(&sharedData->mutex);
+    printw("\nLink status: %s\n", sharedData->connected ? "connected" : "disconnected");
+    printw("  RTT smoothed: ");
+    printRtt(rtt);
+    printw("\n");
+    if(rtt->samples > 0)
+    {
+        printw("  RTT last/min/max: %" PRIu64 " / %" PRIu64 " / %" PRIu64 " us over %" PRIu64 " samples\n", rtt->lastUs, rtt->minUs, rtt->maxUs, rtt->samples);
+    }
+    printw("  Heartbeat every %" PRIu32 " ms, server declared dead after %" PRIu32 " missed\n\n", sharedData->heartbeat.intervalMs, sharedData->heartbeat.maxMisses);
+    pthread_mutex_unlock(&sharedData->mutex);
 }
 
 bool verifyMessageFormat(Packet packet)
@@ -163,92 +538,83 @@ void sendToServer(int sockfd, const char *message)
      * sockfd: The socket file descriptor
      * message: The message to send
      */
-    uint8_t  version_packet;
-    uint16_t content_length_packet;
+    size_t length = strlen(message);
 
-    // Create the version packet
-    version_packet = (uint8_t)CURRENT_VERSION;
-    send(sockfd, &version_packet, sizeof(version_packet), 0);
-    printw("\nDebug: Sending version: %d\n", version_packet);
+    printw("\nDebug: Sending version: %d\n", CURRENT_VERSION);
+    printw("Debug: Sending length: %zu\n", length);
+    printw("Debug: Sending content: %s\n", message);
+    sendControl(sockfd, message, length);
+}
 
-    content_length_packet = htons(strlen(message));
-    printw("Debug: Sending string length: %d\n", strlen(message));
-    send(sockfd, &content_length_packet, sizeof(uint16_t), 0);
-    printw("Debug: Sending length: %u\n", ntohs(content_length_packet));
+void sendControl(int sockfd, const char *content, size_t length)
+{
+    /**
+     * Send a frame without any debug output
+     * Serialised so the listening thread's heartbeats never interleave with a command frame
+     */
+    static pthread_mutex_t sendMutex = PTHREAD_MUTEX_INITIALIZER;
 
-    // Create the content packet
-    send(sockfd, message, strlen(message), 0);
-    printw("Debug: Sending content: %s\n", message);
+    pthread_mutex_lock(&sendMutex);
+    if(sendFrame(sockfd, content, length) == -1)
+    {
+        printw("Debug: Send failed\n");
+    }
+    pthread_mutex_unlock(&sendMutex);
 }
 
-Packet receiveFromServer(int sockfd)
+bool receiveFromServer(int sockfd, int timeoutMs, Packet *packet)
 {
     /**
      * Receives a packet from the server.
+     * timeoutMs: How long a partially received frame may stall before the connection is treated as dead
+     * Return False on failure or a closed socket
      */
-    Packet   packet;
-    uint8_t  version;
-    uint16_t contentLength;
+    static uint8_t frame[FRAME_HEADER_SIZE + MAX_FRAME_CONTENT];    // Only the listening thread receives
+    uint16_t       contentLength;
+
+    packet->version       = 0;
+    packet->contentLength = 0;
+    packet->content       = NULL;
 
-    // Receive the version packet
-    if(recv(sockfd, &version, sizeof(version), 0) > 0)
+    // Receive the version and content length, then the content behind them
+    if(recvAll(sockfd, frame, FRAME_HEADER_SIZE, timeoutMs) <= 0)
     {
-        packet.version = version;
-        printw("\nDebug: Received version: %d\n", packet.version);
+        return false;
     }
-    else
+    contentLength = decodeFrameLength(frame);
+    if(contentLength > 0 && recvAll(sockfd, frame + FRAME_HEADER_SIZE, contentLength, timeoutMs) <= 0)
     {
-        close(sockfd);
-        packet.version       = 0;
-        packet.contentLength = 0;
-        packet.content       = NULL;
-        return packet;
+        return false;
     }
 
-    // Receive the content length packet
-    if(recv(sockfd, &contentLength, sizeof(contentLength), 0) > 0)
+    // Copy out the content so the packet outlives the next receive
+    if(copyFrame(frame, FRAME_HEADER_SIZE + (size_t)contentLength, packet) == 0)
     {
-        packet.contentLength = ntohs(contentLength);
-        printw("Debug: Received Content Length: %u\n", packet.contentLength);
-    }
-    else
-    {
-        close(sockfd);
-        packet.version       = 0;
-        packet.contentLength = 0;
-        packet.content       = NULL;
-        return packet;
+        return false;
     }
 
-    // Allocate memory for the content
-    packet.content = (char *)malloc(packet.contentLength + 1);
-
-    // Receive the content packet
-    if(recv(sockfd, packet.content, packet.contentLength, 0) <= 0)
+    if(!isHeartbeat(*packet) && !isControlFrame(packet->content, packet->contentLength, STREAM_CHUNK) && !isControlFrame(packet->content, packet->contentLength, METRIC_UPDATE))
     {
-        // Silent cleanup without printing error messages
-        close(sockfd);
-        free(packet.content);
-        packet.version       = 0;    // Indicate failure or closed socket
-        packet.contentLength = 0;
-        packet.content       = NULL;
-        return packet;
+        printw("\nDebug: Received version: %d\n", packet->version);
+        printw("Debug: Received Content Length: %u\n", packet->contentLength);
+        printw("Debug: Received Content: %s\n\n", packet->content);
     }
 
-    printw("Debug: Received Content: %s\n\n", packet.content);
-
-    return packet;
+    return true;
 }
 
-int connectToServer(char *ipAddress, int portNumber)
+int connectToServer(char *ipAddress, int portNumber, const SocketTuning *tuning)
 {
     /**
      * Connect to the server at the given IP address
      * ipAddress: The IP address of the server
+     * tuning: Socket options applied before connecting, so buffer sizes shape the TCP handshake
      * Return sockfd if successful, 0 otherwise
      */
 
     struct sockaddr_in server_addr;
+    char               description[TUNING_DESCRIPTION_SIZE];
+    int                rejected;
 
     int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if(sockfd == -1)
@@ -257,8 +623,14 @@ int connectToServer(char *ipAddress, int portNumber)
         return 0;
     }
 
+    rejected = applySocketTuning(sockfd, tuning);
+    if(rejected > 0)
+    {
+        printw("Warning: the kernel rejected %d socket options of profile %s\n", rejected, tuning->name);
+    }
+
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port   = htons(portNumber);
+    server_addr.sin_port   = htons((uint16_t)portNumber);    // getSocketInformation keeps it within MAX_PORT
     if(inet_pton(AF_INET, ipAddress, &(server_addr.sin_addr)) <= 0)
     {
         printw("inet_pton Error.\n");
@@ -274,6 +646,8 @@ int connectToServer(char *ipAddress, int portNumber)
     }
 
     printw("Connection successful\n");
+    describeSocketTuning(sockfd, tuning, description, sizeof(description));
+    printw("Socket tuning %s\n", description);
     return sockfd;
 }
 
@@ -337,6 +711,10 @@ void printMenu(void)
     printw("2. Start the server\n");
     printw("3. Stop the server\n");
     printw("4. Exit the program\n");
+    printw("5. Show link status\n");
+    printw("6. Download the server log\n");
+    printw("7. Download the connection table\n");
+    printw("8. Show fleet status (through a gateway)\n");
     printw("Enter your choice: ");
     refresh();
 }
@@ -359,17 +737,16 @@ bool isRestrictedPort(long port)
     return false;
 }
 
-ServerInfo getSocketInformation(void)
+void getSocketInformation(ServerInfo *serverInfo)
 {
     /**
      * Get the IP address and port number of the server
-     * Return The server information
+     * serverInfo: Filled with the server information
      */
     char *ipAddress;
     // bool       isValidAddress;
     // int        portNumber = 0;
-    char      *endPtr;
-    ServerInfo serverInfo;
+    char *endPtr;
 
     while(1)
     {
@@ -384,7 +761,7 @@ ServerInfo getSocketInformation(void)
         else
         {
             printw("\nThe IP address %s is a valid IP address.\n", ipAddress);
-            serverInfo.ipAddress = ipAddress;
+            serverInfo->ipAddress = ipAddress;
             break;
         }
     }
@@ -411,26 +788,133 @@ ServerInfo getSocketInformation(void)
         {
             free(portNumberStr);
             printw("\nThe port number %d is a valid port number.\n", (int)portValue);
-            serverInfo.portNumber = (int)portValue;
+            serverInfo->portNumber = (int)portValue;
             break;
         }
     }
-    return serverInfo;
 }
 
-int main(void)
+uint32_t parseHeartbeatOption(const char *value)
+{
+    /**
+     * Parse a positive heartbeat setting from the command line
+     * Return the value, 0 if it is not a valid positive number
+     */
+    char *endPtr;
+    long  parsed = strtol(value, &endPtr, DECIMAL);
+
+    if(endPtr == value || *endPtr != '\0' || parsed <= 0 || parsed > INT32_MAX)
+    {
+        return 0;
+    }
+    return (uint32_t)parsed;
+}
+
+uint32_t parseMetricInterval(const char *value)
+{
+    /**
+     * Parse the metric update interval from the command line
+     * Return the interval in milliseconds, 0 if it is not a number or faster than the server allows
+     */
+    char *endPtr;
+    long  parsed = strtol(value, &endPtr, DECIMAL);
+
+    if(endPtr == value || *endPtr != '\0' || parsed < METRIC_MIN_INTERVAL_MS || parsed > INT32_MAX)
+    {
+        return 0;
+    }
+    return (uint32_t)parsed;
+}
+
+void subscribeToMetrics(int sockfd, uint32_t mask, uint32_t intervalMs)
+{
+    /**
+     * Ask the server to push the chosen metrics, changed values only, at most every intervalMs
+     */
+    char request[CONTROL_BUFFER_SIZE];
+    int  length = snprintf(request, sizeof(request), METRIC_SUBSCRIBE " %" PRIu32 " %" PRIu32, mask, intervalMs);
+
+    sendControl(sockfd, request, (size_t)length);
+}
+
+int main(int argc, char *argv[])
 {
     /**
      * Main function.
+     * -i: Heartbeat interval in milliseconds
+     * -m: Missed heartbeats before the server is declared dead
+     * -p: Socket tuning profile
+     * -c: Socket tuning file, applied on top of the profile
+     * -M: Comma separated metrics to subscribe to, or "all"
+     * -r: Metric update interval in milliseconds
      */
     int               sockfd;
-    bool              running       = true;
-    bool              serverRunning = false;
+    int               option;
+    uint32_t          heartbeatIntervalMs = HEARTBEAT_INTERVAL_MS;
+    uint32_t          heartbeatMaxMisses  = HEARTBEAT_MAX_MISSES;
+    uint32_t          metricMask          = METRIC_ALL;
+    uint32_t          metricIntervalMs    = METRIC_DEFAULT_INTERVAL_MS;
+    bool              running             = true;
+    SocketTuning      tuning;
+    char              profiles[TUNING_DESCRIPTION_SIZE];
     pthread_t         listenThread;
+    bool              listening;
     bool              passwordAccepted;
     struct SharedData sharedData;
     struct ThreadArgs args;
 
+    findTuningProfile(TUNING_DEFAULT_PROFILE, &tuning);
+
+    while((option = getopt(argc, argv, "i:m:p:c:M:r:")) != -1)
+    {
+        switch(option)
+        {
+            case 'i':
+                heartbeatIntervalMs = parseHeartbeatOption(optarg);
+                break;
+            case 'm':
+                heartbeatMaxMisses = parseHeartbeatOption(optarg);
+                break;
+            case 'p':
+                if(!findTuningProfile(optarg, &tuning))
+                {
+                    listTuningProfiles(profiles, sizeof(profiles));
+                    fprintf(stderr, "Unknown socket profile %s, expected one of: %s\n", optarg, profiles);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'c':
+                if(!loadTuningFile(optarg, &tuning))
+                {
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'M':
+                if(!parseMetricNames(optarg, &metricMask))
+                {
+                    fprintf(stderr, "Unknown metric in %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'r':
+                metricIntervalMs = parseMetricInterval(optarg);
+                if(metricIntervalMs == 0)
+                {
+                    fprintf(stderr, "Invalid metric interval %s, expected at least %d ms\n", optarg, METRIC_MIN_INTERVAL_MS);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                heartbeatIntervalMs = 0;
+        }
+        if(heartbeatIntervalMs == 0 || heartbeatMaxMisses == 0)
+        {
+            fprintf(stderr, "Usage: %s [-i heartbeat interval ms] [-m missed heartbeats before disconnect] [-p socket profile] [-c socket tuning file] [-M metrics] [-r metric interval ms]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    tuning.backlog = TUNING_UNSET;    // Only the server listens
+
     initscr();                 // Initialize the screen
     scrollok(stdscr, TRUE);    // Enable scrolling
     cbreak();                  // Line buffering disabled, Pass on every character
@@ -439,8 +923,14 @@ int main(void)
 
     pthread_mutex_init(&sharedData.mutex, NULL);
     pthread_cond_init(&sharedData.condVar, NULL);
-    sharedData.newDataFlag = 0;
-    sharedData.running     = true;
+    sharedData.newDataFlag   = 0;
+    sharedData.running       = true;
+    sharedData.download.fd   = -1;
+    sharedData.serverRunning = false;
+    sharedData.stateKnown    = false;
+    sharedData.stateVersion  = 0;
+    sharedData.metricSeq     = 0;
+    sharedData.metricsKnown  = false;
 
     printw("--- COMP 4985 Project: Server Manager Program ---\n");
 
@@ -453,16 +943,21 @@ int main(void)
         char      *ipAddress;
         ServerInfo serverInfo;
 
-        serverInfo = getSocketInformation();
+        getSocketInformation(&serverInfo);
         ipAddress  = serverInfo.ipAddress;
         portNumber = serverInfo.portNumber;
-        sockfd     = connectToServer(ipAddress, portNumber);
+        sockfd     = connectToServer(ipAddress, portNumber, &tuning);
     }
 
+    sharedData.connected = true;
+    heartbeatInit(&sharedData.heartbeat, heartbeatIntervalMs, heartbeatMaxMisses, monotonicMillis());
+
     args.sockfd     = sockfd;
+    args.tuning     = &tuning;
     args.sharedData = &sharedData;    // Pass a pointer to sharedData to the listening thread
 
-    if(pthread_create(&listenThread, NULL, (void *(*)(void *))listenToServer, (void *)&args) != 0)
+    listening = pthread_create(&listenThread, NULL, (void *(*)(void *))listenToServer, (void *)&args) == 0;
+    if(!listening)
     {
         perror("pthread_create");
     }
@@ -496,10 +991,15 @@ int main(void)
                 {
                     pthread_cond_wait(&sharedData.condVar, &sharedData.mutex);
                 }
-                if((strcmp(sharedData.newData, "ACCEPTED") == 0) || (strcmp(sharedData.newData, "ACCEPTED\n") == 0))
+                if(!sharedData.connected)
+                {
+                    printw("-- Lost connection to the server. Restart the program to reconnect. --\n");
+                }
+                else if((strcmp(sharedData.newData, "ACCEPTED") == 0) || (strcmp(sharedData.newData, "ACCEPTED\n") == 0))
                 {
                     printw("-- Password accepted. You may send commands to start/stop the server. --\n\n");
                     passwordAccepted = true;
+                    subscribeToMetrics(sockfd, metricMask, metricIntervalMs);
                 }
                 else
                 {
@@ -517,13 +1017,13 @@ int main(void)
                 {
                     printw("Please connect to the server first!\n");
                 }
-                else if(serverRunning)
+                else if(isServerRunning(&sharedData))
                 {
                     printw("The server is already running!\n");
                 }
                 else
                 {
-                    sendToServer(sockfd, "/s");
+                    sendToServer(sockfd, START_REQUEST);
                     pthread_mutex_lock(&sharedData.mutex);
                     while(sharedData.newDataFlag == 0)
                     {
@@ -531,10 +1031,13 @@ int main(void)
                     }
                     // if(sharedData.newDataFlag)
                     // {
-                    if((strcmp(sharedData.newData, "STARTED") == 0) || (strcmp(sharedData.newData, "STARTED\n") == 0))
+                    if(!sharedData.connected)
+                    {
+                        printw("-- Lost connection to the server. Restart the program to reconnect. --\n");
+                    }
+                    else if((strcmp(sharedData.newData, "STARTED") == 0) || (strcmp(sharedData.newData, "STARTED\n") == 0))
                     {
                         printw("-- Server started. Server will be accepting incoming client connections. --\n");
-                        serverRunning = true;
                     }
                     else
                     {
@@ -553,22 +1056,25 @@ int main(void)
                 {
                     printw("Please connect to the server first !\n");
                 }
-                else if(!serverRunning)
+                else if(!isServerRunning(&sharedData))
                 {
                     printw("The server is already stopped !\n");
                 }
                 else
                 {
-                    sendToServer(sockfd, "/q");
+                    sendToServer(sockfd, STOP_REQUEST);
                     pthread_mutex_lock(&sharedData.mutex);
                     while(sharedData.newDataFlag == 0)
                     {
                         pthread_cond_wait(&sharedData.condVar, &sharedData.mutex);
                     }
-                    if((strcmp(sharedData.newData, "STOPPED") == 0) || (strcmp(sharedData.newData, "STOPPED\n") == 0))
+                    if(!sharedData.connected)
+                    {
+                        printw("-- Lost connection to the server. Restart the program to reconnect. --\n");
+                    }
+                    else if((strcmp(sharedData.newData, "STOPPED") == 0) || (strcmp(sharedData.newData, "STOPPED\n") == 0))
                     {
                         printw("-- Server stopped. Server will not be accepting incoming client connections. --\n");
-                        serverRunning = false;
                     }
                     else
                     {
@@ -587,6 +1093,15 @@ int main(void)
                 sharedData.running = false;
                 pthread_mutex_unlock(&sharedData.mutex);
                 // free(ipAddress);
+                shutdown(sockfd, SHUT_RDWR);    // Wakes the listening thread so it can be joined
+                if(listening)
+                {
+                    pthread_join(listenThread, NULL);
+                }
+                if(sharedData.download.fd != -1)
+                {
+                    finishDownload(&sharedData.download);
+                }
                 close(sockfd);
                 pthread_mutex_destroy(&sharedData.mutex);
                 pthread_cond_destroy(&sharedData.condVar);
@@ -594,6 +1109,50 @@ int main(void)
                 printw("-- Cleanup is complete. --\n");
                 break;
             }
+            case 5:
+            {
+                printLinkStatus(&sharedData);
+                break;
+            }
+            case 6:
+            case 7:
+            {
+                if(!passwordAccepted)
+                {
+                    printw("\nPlease connect to the server first!\n");
+                }
+                else
+                {
+                    requestDownload(sockfd, &sharedData, choice == 6 ? STREAM_LOG_REQUEST : STREAM_TABLE_REQUEST, choice == 6 ? "server.log" : "connections.txt");
+                }
+                break;
+            }
+            case 8:
+            {
+                if(!passwordAccepted)
+                {
+                    printw("\nPlease connect to the gateway first!\n");
+                    break;
+                }
+                // The listening thread prints the status as it arrives
+                sendToServer(sockfd, FLEET_REQUEST);
+                pthread_mutex_lock(&sharedData.mutex);
+                while(sharedData.newDataFlag == 0)
+                {
+                    pthread_cond_wait(&sharedData.condVar, &sharedData.mutex);
+                }
+                if(!sharedData.connected)
+                {
+                    printw("-- Lost connection to the server. Restart the program to reconnect. --\n");
+                }
+                else if(!isControlFrame(sharedData.newData, strnlen(sharedData.newData, sizeof(sharedData.newData)), FLEET_REQUEST))
+                {
+                    printw("-- Fleet status is only available when connected to a gateway. --\n");
+                }
+                sharedData.newDataFlag = 0;
+                pthread_mutex_unlock(&sharedData.mutex);
+                break;
+            }
             default:
             {
                 printw("\nInvalid choice\n");
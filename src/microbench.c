@@ -0,0 +1,469 @@
+#include "protocol.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+    #include <linux/perf_event.h>
+    #include <sys/syscall.h>
+#endif
+
+#define DEFAULT_MINIMUM_MS 200           // Each benchmark doubles its iterations until one run takes this long
+#define MAX_ITERATIONS (UINT64_C(1) << 40)
+#define NANOSECONDS_PER_SECOND 1000000000
+#define NANOSECONDS_PER_MILLISECOND 1000000
+#define FRAMES_PER_RUN 64                // Frames in the back-to-back decode buffer
+#define FRAME_RUN_CAPACITY (FRAMES_PER_RUN * (FRAME_HEADER_SIZE + 32))
+#define LARGE_CONTENT_SIZE 1024
+#define OUTPUT_CAPACITY (FRAME_HEADER_SIZE + LARGE_CONTENT_SIZE)
+#define DECIMAL 10
+#define METRIC_SAMPLE METRIC_UPDATE " \x05\x04\x02\x01"    // Update 5 on top of 4: managers went down by one
+
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+    #define ALLOCATION_HOOKS
+#elif defined(__has_feature)
+    #if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer) || __has_feature(memory_sanitizer)
+        #define ALLOCATION_HOOKS
+    #endif
+#endif
+
+typedef struct Benchmark Benchmark;
+
+struct Benchmark
+{
+    const char *name;
+    uint64_t (*run)(const Benchmark *benchmark, uint64_t iterations);    // Return the number of operations performed
+    const char *content;
+    size_t      length;
+};
+
+typedef struct
+{
+    uint64_t operations;
+    uint64_t elapsedNs;
+    uint64_t allocations;
+    uint64_t cycles;
+    bool     cyclesValid;
+} Measurement;
+
+static volatile uint64_t sink;           // Keeps the compiler from discarding benchmarked work
+static uint64_t          allocations;    // Bumped on every allocation while counting is available
+static uint8_t           frameRun[FRAME_RUN_CAPACITY];
+static size_t            frameRunLength;
+static char              largeContent[LARGE_CONTENT_SIZE];
+static int64_t           metricValues[METRIC_COUNT];
+static int64_t           metricBase[METRIC_COUNT];
+
+#if defined(ALLOCATION_HOOKS)
+// From <sanitizer/allocator_interface.h>, which not every toolchain installs
+int __sanitizer_install_malloc_and_free_hooks(void (*mallocHook)(const volatile void *, size_t), void (*freeHook)(const volatile void *));    // NOLINT(bugprone-reserved-identifier,cert-dcl37-c,cert-dcl51-cpp)
+
+static void countMalloc(const volatile void *ptr, size_t size)
+{
+    (void)ptr;
+    (void)size;
+    allocations++;
+}
+
+static void countFree(const volatile void *ptr)
+{
+    (void)ptr;
+}
+
+static bool startCountingAllocations(void)
+{
+    /**
+     * Sanitizers own the allocator, so count through their hooks
+     */
+    return __sanitizer_install_malloc_and_free_hooks(countMalloc, countFree) != 0;
+}
+#elif defined(__GLIBC__)
+// glibc exports its allocator under these names so a program can wrap malloc
+extern void *__libc_malloc(size_t size);                   // NOLINT(bugprone-reserved-identifier,cert-dcl37-c,cert-dcl51-cpp)
+extern void *__libc_calloc(size_t count, size_t size);     // NOLINT(bugprone-reserved-identifier,cert-dcl37-c,cert-dcl51-cpp)
+extern void *__libc_realloc(void *ptr, size_t size);       // NOLINT(bugprone-reserved-identifier,cert-dcl37-c,cert-dcl51-cpp)
+
+void *malloc(size_t size)    // NOLINT(bugprone-reserved-identifier,cert-dcl37-c,cert-dcl51-cpp)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)    // NOLINT(bugprone-reserved-identifier,cert-dcl37-c,cert-dcl51-cpp)
+{
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)    // NOLINT(bugprone-reserved-identifier,cert-dcl37-c,cert-dcl51-cpp)
+{
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+static bool startCountingAllocations(void)
+{
+    return true;
+}
+#else
+static bool startCountingAllocations(void)
+{
+    return false;
+}
+#endif
+
+static uint64_t monotonicNanos(void)
+{
+    /**
+     * Get a monotonic timestamp in nanoseconds
+     */
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * NANOSECONDS_PER_SECOND) + (uint64_t)now.tv_nsec;
+}
+
+static int openCycleCounter(void)
+{
+    /**
+     * Count user space CPU cycles of this thread with a hardware perf counter
+     * Return the counter fd, or -1 if the kernel or the container does not allow it
+     */
+#ifdef __linux__
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.size           = sizeof(attr);
+    attr.config         = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static bool readCycles(int counterfd, uint64_t *cycles)
+{
+    return counterfd != -1 && read(counterfd, cycles, sizeof(*cycles)) == (ssize_t)sizeof(*cycles);
+}
+
+static uint64_t runEncode(const Benchmark *benchmark, uint64_t iterations)
+{
+    /**
+     * Build a frame into an output buffer the way sendPacket queues a reply
+     */
+    uint8_t buffer[OUTPUT_CAPACITY];
+
+    for(uint64_t i = 0; i < iterations; i++)
+    {
+        sink += encodeFrame(buffer, sizeof(buffer), benchmark->content, benchmark->length);
+    }
+    return iterations;
+}
+
+static uint64_t runDecodeInPlace(const Benchmark *benchmark, uint64_t iterations)
+{
+    /**
+     * Walk a buffer of back-to-back frames without copying, as receivePackets does
+     */
+    uint64_t frames = 0;
+
+    (void)benchmark;
+
+    for(uint64_t i = 0; i < iterations; i++)
+    {
+        size_t offset = 0;
+        size_t used;
+        Packet packet;
+
+        while((used = decodeFrame(frameRun + offset, frameRunLength - offset, &packet)) > 0)
+        {
+            sink += packet.contentLength;
+            offset += used;
+            frames++;
+        }
+    }
+    return frames;
+}
+
+static uint64_t runDecodeCopy(const Benchmark *benchmark, uint64_t iterations)
+{
+    /**
+     * Copy the same frames out one by one with copyFrame, as receiveFromServer does after recvAll
+     */
+    uint64_t frames = 0;
+
+    (void)benchmark;
+
+    for(uint64_t i = 0; i < iterations; i++)
+    {
+        size_t offset = 0;
+        size_t used;
+        Packet packet;
+
+        while((used = copyFrame(frameRun + offset, frameRunLength - offset, &packet)) > 0)
+        {
+            sink += (uint64_t)packet.content[0];
+            free(packet.content);
+            offset += used;
+            frames++;
+        }
+    }
+    return frames;
+}
+
+static uint64_t runDispatch(const Benchmark *benchmark, uint64_t iterations)
+{
+    /**
+     * Classify a client command the way handlePacket dispatches it
+     */
+    for(uint64_t i = 0; i < iterations; i++)
+    {
+        sink += (uint64_t)classifyCommand(benchmark->content, benchmark->length);
+    }
+    return iterations;
+}
+
+static uint64_t runClassify(const Benchmark *benchmark, uint64_t iterations)
+{
+    /**
+     * Classify a server reply the way the manager's listening thread does
+     */
+    for(uint64_t i = 0; i < iterations; i++)
+    {
+        sink += (uint64_t)classifyReply(benchmark->content, benchmark->length);
+    }
+    return iterations;
+}
+
+static uint64_t runEncodeMetricDelta(const Benchmark *benchmark, uint64_t iterations)
+{
+    /**
+     * Find the changed metrics and encode them against the acknowledged snapshot, as sendMetrics does between keyframes
+     */
+    char update[METRIC_UPDATE_SIZE];
+
+    (void)benchmark;
+
+    for(uint64_t i = 0; i < iterations; i++)
+    {
+        uint32_t mask = changedMetrics(metricValues, metricBase, METRIC_ALL);
+        sink += encodeMetricUpdate(update, sizeof(update), i + 1, metricValues, metricBase, i, mask);
+    }
+    return iterations;
+}
+
+static uint64_t runEncodeMetricKeyframe(const Benchmark *benchmark, uint64_t iterations)
+{
+    /**
+     * Encode every metric in full, as sendMetrics does for a keyframe
+     */
+    char update[METRIC_UPDATE_SIZE];
+
+    (void)benchmark;
+
+    for(uint64_t i = 0; i < iterations; i++)
+    {
+        sink += encodeMetricUpdate(update, sizeof(update), i + 1, metricValues, NULL, 0, METRIC_ALL);
+    }
+    return iterations;
+}
+
+static uint64_t runDecodeMetrics(const Benchmark *benchmark, uint64_t iterations)
+{
+    /**
+     * Decode an update and apply it to the manager's copy, as handleMetricUpdate does
+     */
+    int64_t values[METRIC_COUNT] = {0};
+
+    for(uint64_t i = 0; i < iterations; i++)
+    {
+        MetricUpdate update;
+        if(decodeMetricUpdate(benchmark->content, benchmark->length, &update))
+        {
+            applyMetricUpdate(&update, values);
+        }
+    }
+    sink += (uint64_t)values[METRIC_MANAGERS];
+    return iterations;
+}
+
+static void buildMetrics(void)
+{
+    /**
+     * A busy server between two updates: a few counters moved, the rest did not
+     */
+    for(int metric = 0; metric < METRIC_COUNT; metric++)
+    {
+        metricBase[metric]   = (int64_t)metric * DECIMAL * DECIMAL * DECIMAL;
+        metricValues[metric] = metricBase[metric];
+    }
+    metricValues[METRIC_CONNECTIONS]++;
+    metricValues[METRIC_FRAMES_RECEIVED] += DECIMAL;
+    metricValues[METRIC_UPTIME_SECONDS]++;
+}
+
+static void buildFrameRun(void)
+{
+    /**
+     * Fill frameRun with the mix of frames a busy connection sees
+     */
+    static const char *const samples[] = {"/ping 1712345678901", "/ma 12", "STARTED", "/u 42 STARTED", "ACCEPTED", "/k 7 3", "/s", "UNKNOWN COMMAND"};
+
+    frameRunLength = 0;
+    for(size_t i = 0; i < FRAMES_PER_RUN; i++)
+    {
+        const char *sample = samples[i % (sizeof(samples) / sizeof(samples[0]))];
+        frameRunLength += encodeFrame(frameRun + frameRunLength, sizeof(frameRun) - frameRunLength, sample, strlen(sample));
+    }
+}
+
+static void measure(const Benchmark *benchmark, uint64_t iterations, int counterfd, Measurement *measurement)
+{
+    /**
+     * Run one timed pass, recording allocations and cycles around it
+     */
+    uint64_t cyclesBefore = 0;
+    uint64_t cyclesAfter  = 0;
+    uint64_t allocationsBefore;
+    uint64_t start;
+
+    measurement->cyclesValid = readCycles(counterfd, &cyclesBefore);
+    allocationsBefore        = allocations;
+    start                    = monotonicNanos();
+
+    measurement->operations  = benchmark->run(benchmark, iterations);
+    measurement->elapsedNs   = monotonicNanos() - start;
+    measurement->allocations = allocations - allocationsBefore;
+    measurement->cyclesValid = measurement->cyclesValid && readCycles(counterfd, &cyclesAfter);
+    measurement->cycles      = cyclesAfter - cyclesBefore;
+}
+
+static void report(const Benchmark *benchmark, const Measurement *measurement, bool countingAllocations)
+{
+    /**
+     * Print one result row, n/a where a counter is unavailable
+     */
+    double operations = measurement->operations > 0 ? (double)measurement->operations : 1.0;
+
+    printf("%-36s %14" PRIu64 " %10.2f", benchmark->name, measurement->operations, (double)measurement->elapsedNs / operations);
+    if(countingAllocations)
+    {
+        printf(" %10.2f", (double)measurement->allocations / operations);
+    }
+    else
+    {
+        printf(" %10s", "n/a");
+    }
+    if(measurement->cyclesValid)
+    {
+        printf(" %10.1f\n", (double)measurement->cycles / operations);
+    }
+    else
+    {
+        printf(" %10s\n", "n/a");
+    }
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-d <minimum ms per benchmark>] [name filter]\n", program);
+}
+
+int main(int argc, char *argv[])
+{
+    /**
+     * Benchmark the CPU-only paths of the protocol without any sockets
+     * Every benchmark doubles its iteration count until a single pass runs for the minimum time, then reports that pass
+     */
+    // clang-format off
+    static const Benchmark benchmarks[] = {
+        {"encode STARTED (sendPacket)",         runEncode,               STATE_STARTED,     sizeof(STATE_STARTED) - 1},
+        {"encode 1 KiB (sendPacket)",           runEncode,               largeContent,      sizeof(largeContent)},
+        {"decode in place (receivePackets)",    runDecodeInPlace,        NULL,              0},
+        {"decode copy (receiveFromServer)",     runDecodeCopy,           NULL,              0},
+        {"dispatch /s (handlePacket)",          runDispatch,             START_REQUEST,     sizeof(START_REQUEST) - 1},
+        {"dispatch /q (handlePacket)",          runDispatch,             STOP_REQUEST,      sizeof(STOP_REQUEST) - 1},
+        {"dispatch unknown (handlePacket)",     runDispatch,             "/x",              sizeof("/x") - 1},
+        {"classify STOPPED (listenToServer)",   runClassify,             STATE_STOPPED,     sizeof(STATE_STOPPED) - 1},
+        {"classify ACCEPTED (listenToServer)",  runClassify,             "ACCEPTED",        sizeof("ACCEPTED") - 1},
+        {"classify /mu (listenToServer)",       runClassify,             METRIC_SAMPLE,     sizeof(METRIC_SAMPLE) - 1},
+        {"classify other (listenToServer)",     runClassify,             "UNKNOWN COMMAND", sizeof("UNKNOWN COMMAND") - 1},
+        {"encode delta (sendMetrics)",          runEncodeMetricDelta,    NULL,              0},
+        {"encode keyframe (sendMetrics)",       runEncodeMetricKeyframe, NULL,              0},
+        {"decode metrics (handleMetricUpdate)", runDecodeMetrics,        METRIC_SAMPLE,     sizeof(METRIC_SAMPLE) - 1},
+    };
+    // clang-format on
+    const char *filter    = NULL;
+    uint64_t    minimumNs = (uint64_t)DEFAULT_MINIMUM_MS * NANOSECONDS_PER_MILLISECOND;
+    bool        countingAllocations;
+    int         counterfd;
+    int         option;
+
+    while((option = getopt(argc, argv, "d:")) != -1)
+    {
+        if(option == 'd')
+        {
+            char *endPtr;
+            long  value = strtol(optarg, &endPtr, DECIMAL);
+            if(endPtr == optarg || *endPtr != '\0' || value <= 0)
+            {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            minimumNs = (uint64_t)value * NANOSECONDS_PER_MILLISECOND;
+        }
+        else
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if(optind < argc)
+    {
+        filter = argv[optind];
+    }
+
+    memset(largeContent, 'x', sizeof(largeContent));
+    buildFrameRun();
+    buildMetrics();
+
+    countingAllocations = startCountingAllocations();
+    counterfd           = openCycleCounter();
+    if(counterfd == -1)
+    {
+        fprintf(stderr, "Cycle counter unavailable (%s), cycles/op not reported\n", strerror(errno));
+    }
+
+    printf("%-36s %14s %10s %10s %10s\n", "benchmark", "ops", "ns/op", "allocs/op", "cycles/op");
+    for(size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++)
+    {
+        Measurement measurement;
+        uint64_t    iterations = 1;
+
+        if(filter != NULL && strstr(benchmarks[i].name, filter) == NULL)
+        {
+            continue;
+        }
+
+        measure(&benchmarks[i], iterations, counterfd, &measurement);    // Fault in code and data before timing
+        do
+        {
+            measure(&benchmarks[i], iterations, counterfd, &measurement);
+            iterations *= 2;
+        } while(measurement.elapsedNs < minimumNs && iterations <= MAX_ITERATIONS);
+
+        report(&benchmarks[i], &measurement, countingAllocations);
+    }
+
+    if(counterfd != -1)
+    {
+        close(counterfd);
+    }
+    return EXIT_SUCCESS;
+}
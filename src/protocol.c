@@ -0,0 +1,969 @@
+#include "protocol.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define NANOSECONDS_PER_MICROSECOND 1000
+#define MICROSECONDS_PER_SECOND 1000000
+#define RTT_GAIN_SHIFT 3            // srtt += (sample - srtt) / 8, as in RFC 6298
+#define DECIMAL 10
+#define VARINT_PAYLOAD 0x7F         // Value bits of a varint byte
+#define VARINT_CONTINUE 0x80        // Set on every varint byte but the last
+#define VARINT_SHIFT 7
+#define VARINT_MAX_BYTES 10         // Enough for 64 bits
+
+#ifndef MSG_NOSIGNAL
+    #define MSG_NOSIGNAL 0
+#endif
+
+uint64_t monotonicMicros(void)
+{
+    /**
+     * Current value of the monotonic clock in microseconds
+     */
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * MICROSECONDS_PER_SECOND) + ((uint64_t)now.tv_nsec / NANOSECONDS_PER_MICROSECOND);
+}
+
+uint64_t monotonicMillis(void)
+{
+    /**
+     * Current value of the monotonic clock in milliseconds
+     */
+    return monotonicMicros() / MICROSECONDS_PER_MILLISECOND;
+}
+
+void encodeFrameHeader(uint8_t *buffer, size_t length)
+{
+    /**
+     * Write the version and big endian length that precede length bytes of content
+     */
+    uint16_t networkLength = htons((uint16_t)length);
+
+    buffer[0] = CURRENT_VERSION;
+    memcpy(buffer + 1, &networkLength, sizeof(networkLength));
+}
+
+size_t encodeFrame(uint8_t *buffer, size_t capacity, const char *content, size_t length)
+{
+    /**
+     * Encode a frame (version, big endian length, content) into buffer
+     * Return the number of bytes written, 0 if the frame does not fit
+     */
+    if(length > MAX_FRAME_CONTENT || capacity < FRAME_HEADER_SIZE + length)
+    {
+        return 0;
+    }
+
+    encodeFrameHeader(buffer, length);
+    memcpy(buffer + FRAME_HEADER_SIZE, content, length);
+    return FRAME_HEADER_SIZE + length;
+}
+
+size_t decodeFrame(const uint8_t *buffer, size_t available, Packet *packet)
+{
+    /**
+     * Decode the frame at the start of buffer without copying
+     * packet->content points into buffer and is not NUL terminated
+     * Return the number of bytes the frame occupies, 0 if it is incomplete
+     */
+    size_t length;
+
+    if(available < FRAME_HEADER_SIZE)
+    {
+        return 0;
+    }
+
+    length = decodeFrameLength(buffer);
+    if(available < FRAME_HEADER_SIZE + length)
+    {
+        return 0;
+    }
+
+    packet->version       = buffer[0];
+    packet->contentLength = (uint16_t)length;
+    packet->content       = (char *)(uintptr_t)(buffer + FRAME_HEADER_SIZE);
+    return FRAME_HEADER_SIZE + length;
+}
+
+size_t copyFrame(const uint8_t *buffer, size_t available, Packet *packet)
+{
+    /**
+     * Decode the frame at the start of buffer into a freshly allocated, NUL terminated copy
+     * The caller owns packet->content and frees it
+     * Return the number of bytes the frame occupies, 0 if it is incomplete or out of memory
+     */
+    Packet view;
+    size_t used = decodeFrame(buffer, available, &view);
+
+    if(used == 0)
+    {
+        return 0;
+    }
+
+    packet->content = (char *)malloc((size_t)view.contentLength + 1);
+    if(packet->content == NULL)
+    {
+        return 0;
+    }
+    memcpy(packet->content, view.content, view.contentLength);
+    packet->content[view.contentLength] = '\0';
+    packet->contentLength               = view.contentLength;
+    packet->version                     = view.version;
+    return used;
+}
+
+uint16_t decodeFrameLength(const uint8_t *header)
+{
+    /**
+     * Read the content length from a complete frame header
+     */
+    uint16_t networkLength;
+
+    memcpy(&networkLength, header + 1, sizeof(networkLength));
+    return ntohs(networkLength);
+}
+
+int sendFrame(int sockfd, const char *content, size_t length)
+{
+    /**
+     * Send a whole frame on a blocking socket
+     * The header and content go out in a single gathered write so a frame is never split across segments by Nagle
+     * Return 0 on success, -1 on failure
+     */
+    uint8_t       header[FRAME_HEADER_SIZE];
+    struct iovec  parts[2];
+    struct msghdr message;
+    size_t        remaining;
+
+    if(length > MAX_FRAME_CONTENT)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    encodeFrameHeader(header, length);
+
+    parts[0].iov_base = header;
+    parts[0].iov_len  = sizeof(header);
+    parts[1].iov_base = (void *)(uintptr_t)content;
+    parts[1].iov_len  = length;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov    = parts;
+    message.msg_iovlen = 2;
+    remaining          = sizeof(header) + length;
+
+    while(remaining > 0)
+    {
+        ssize_t sent = sendmsg(sockfd, &message, MSG_NOSIGNAL);
+        if(sent == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        remaining -= (size_t)sent;
+
+        // Skip over whatever was written on a short send
+        while(message.msg_iovlen > 0 && (size_t)sent >= message.msg_iov[0].iov_len)
+        {
+            sent -= (ssize_t)message.msg_iov[0].iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if(message.msg_iovlen > 0)
+        {
+            message.msg_iov[0].iov_base = (uint8_t *)message.msg_iov[0].iov_base + sent;
+            message.msg_iov[0].iov_len -= (size_t)sent;
+        }
+    }
+    return 0;
+}
+
+bool wouldBlock(int error)
+{
+    /**
+     * Check if a nonblocking socket call failed only because it had to wait
+     * EWOULDBLOCK is only compared where it differs from EAGAIN, on Linux they are the same value
+     */
+#if EAGAIN == EWOULDBLOCK
+    return error == EAGAIN;
+#else
+    return error == EAGAIN || error == EWOULDBLOCK;
+#endif
+}
+
+int recvAll(int sockfd, void *buffer, size_t length, int timeoutMs)
+{
+    /**
+     * Receive exactly length bytes
+     * timeoutMs: Give up after this long without data, negative to wait forever
+     * Return length on success, 0 if the peer closed the connection, -1 on error or timeout
+     */
+    size_t received = 0;
+
+    while(received < length)
+    {
+        struct pollfd pfd;
+        ssize_t       count;
+        int           ready;
+
+        pfd.fd     = sockfd;
+        pfd.events = POLLIN;
+        ready      = poll(&pfd, 1, timeoutMs);
+        if(ready == 0)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if(ready == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        count = recv(sockfd, (uint8_t *)buffer + received, length - received, 0);
+        if(count == 0)
+        {
+            return 0;
+        }
+        if(count == -1)
+        {
+            if(errno == EINTR || wouldBlock(errno))
+            {
+                continue;
+            }
+            return -1;
+        }
+        received += (size_t)count;
+    }
+    return (int)length;
+}
+
+bool isControlFrame(const char *content, size_t length, const char *prefix)
+{
+    /**
+     * Check if content is the control frame prefix, alone or followed by arguments
+     */
+    size_t prefixLength = strlen(prefix);
+
+    if(length < prefixLength || memcmp(content, prefix, prefixLength) != 0)
+    {
+        return false;
+    }
+    return length == prefixLength || content[prefixLength] == ' ';
+}
+
+int formatPing(char *buffer, size_t capacity, uint64_t timestampUs)
+{
+    /**
+     * Write a ping frame carrying the sender's monotonic timestamp
+     * Return the content length
+     */
+    return snprintf(buffer, capacity, "%s %" PRIu64, HEARTBEAT_PING, timestampUs);
+}
+
+int formatPong(char *buffer, size_t capacity, const char *ping, size_t length)
+{
+    /**
+     * Write the pong answering ping, echoing its arguments untouched
+     * Return the content length
+     */
+    size_t prefixLength = strlen(HEARTBEAT_PING);
+
+    return snprintf(buffer, capacity, "%s%.*s", HEARTBEAT_PONG, (int)(length - prefixLength), ping + prefixLength);
+}
+
+bool parseControlNumber(const char *content, size_t length, const char *prefix, uint64_t *value)
+{
+    /**
+     * Extract the single number that follows prefix, e.g. "/ma 12"
+     * Return True if the frame carried exactly one number
+     */
+    char   digits[sizeof("18446744073709551615")];
+    size_t prefixLength = strlen(prefix) + 1;
+    size_t digitsLength;
+    char  *endPtr;
+
+    if(!isControlFrame(content, length, prefix) || length <= prefixLength || length - prefixLength >= sizeof(digits))
+    {
+        return false;
+    }
+
+    digitsLength = length - prefixLength;
+    memcpy(digits, content + prefixLength, digitsLength);
+    digits[digitsLength] = '\0';
+    *value               = strtoull(digits, &endPtr, DECIMAL);
+    return endPtr != digits && *endPtr == '\0';
+}
+
+bool parsePong(const char *content, size_t length, uint64_t *timestampUs)
+{
+    /**
+     * Extract the echoed timestamp from a pong frame
+     * Return True if the frame carried a timestamp
+     */
+    return parseControlNumber(content, length, HEARTBEAT_PONG, timestampUs);
+}
+
+int formatChunkHeader(char *buffer, size_t capacity, uint32_t id, uint32_t seq)
+{
+    /**
+     * Write the text that precedes a chunk's raw bytes
+     * Return the header length
+     */
+    return snprintf(buffer, capacity, "%s %" PRIu32 " %" PRIu32 "\n", STREAM_CHUNK, id, seq);
+}
+
+bool parseChunk(const char *content, size_t length, uint32_t *id, uint32_t *seq, const char **data, size_t *dataLength)
+{
+    /**
+     * Split a chunk frame into its stream id, sequence number and raw bytes
+     * Return True if the frame is a well formed chunk
+     */
+    const char *newline;
+    uint64_t    parsedId;
+    uint64_t    parsedSeq;
+
+    if(!isControlFrame(content, length, STREAM_CHUNK))
+    {
+        return false;
+    }
+
+    newline = (const char *)memchr(content, '\n', length < STREAM_HEADER_SIZE ? length : STREAM_HEADER_SIZE);
+    if(newline == NULL || !parseStreamNumbers(content, (size_t)(newline - content), STREAM_CHUNK, &parsedId, &parsedSeq))
+    {
+        return false;
+    }
+
+    *id         = (uint32_t)parsedId;
+    *seq        = (uint32_t)parsedSeq;
+    *data       = newline + 1;
+    *dataLength = length - (size_t)(newline + 1 - content);
+    return true;
+}
+
+bool parseStreamNumbers(const char *content, size_t length, const char *prefix, uint64_t *first, uint64_t *second)
+{
+    /**
+     * Read the two numbers that follow prefix in a stream control frame, e.g. "/k 3 12"
+     * Anything after the second number (such as the name in a begin frame) is ignored
+     * Return True if both numbers were present
+     */
+    char   text[STREAM_HEADER_SIZE];
+    size_t prefixLength = strlen(prefix);
+    char  *endPtr;
+    char  *secondPtr;
+
+    if(!isControlFrame(content, length, prefix) || length <= prefixLength)
+    {
+        return false;
+    }
+
+    length -= prefixLength;
+    if(length >= sizeof(text))
+    {
+        length = sizeof(text) - 1;
+    }
+    memcpy(text, content + prefixLength, length);
+    text[length] = '\0';
+
+    *first = strtoull(text, &endPtr, DECIMAL);
+    if(endPtr == text || *endPtr != ' ')
+    {
+        return false;
+    }
+    *second = strtoull(endPtr, &secondPtr, DECIMAL);
+    return secondPtr != endPtr && (*secondPtr == '\0' || *secondPtr == ' ');
+}
+
+int formatStateEvent(char *buffer, size_t capacity, uint64_t version, bool running)
+{
+    /**
+     * Write a state change event
+     * Return the content length
+     */
+    return snprintf(buffer, capacity, "%s %" PRIu64 " %s", STATE_EVENT, version, running ? STATE_STARTED : STATE_STOPPED);
+}
+
+bool parseStateEvent(const char *content, size_t length, uint64_t *version, bool *running)
+{
+    /**
+     * Read the version and state out of a state change event
+     * Return True if the event is well formed
+     */
+    char   text[STREAM_HEADER_SIZE];
+    size_t prefixLength = strlen(STATE_EVENT) + 1;
+    char  *endPtr;
+
+    if(!isControlFrame(content, length, STATE_EVENT) || length <= prefixLength || length - prefixLength >= sizeof(text))
+    {
+        return false;
+    }
+
+    memcpy(text, content + prefixLength, length - prefixLength);
+    text[length - prefixLength] = '\0';
+    *version                    = strtoull(text, &endPtr, DECIMAL);
+    if(endPtr == text || *endPtr != ' ')
+    {
+        return false;
+    }
+
+    endPtr++;
+    if(strcmp(endPtr, STATE_STARTED) == 0)
+    {
+        *running = true;
+        return true;
+    }
+    if(strcmp(endPtr, STATE_STOPPED) == 0)
+    {
+        *running = false;
+        return true;
+    }
+    return false;
+}
+
+static bool isExactly(const char *content, size_t length, const char *expected) __attribute__((pure));
+
+static bool isExactly(const char *content, size_t length, const char *expected)
+{
+    /**
+     * Check if content is exactly the expected text
+     */
+    size_t expectedLength = strlen(expected);
+
+    return length == expectedLength && memcmp(content, expected, expectedLength) == 0;
+}
+
+Command classifyCommand(const char *content, size_t length)
+{
+    /**
+     * Work out which command a client frame carries, in the order the server dispatches them
+     */
+    if(isControlFrame(content, length, HEARTBEAT_PING))
+    {
+        return COMMAND_PING;
+    }
+    if(isControlFrame(content, length, HEARTBEAT_PONG))
+    {
+        return COMMAND_PONG;
+    }
+    if(isControlFrame(content, length, STREAM_ACK))
+    {
+        return COMMAND_STREAM_ACK;
+    }
+    if(isControlFrame(content, length, STREAM_CANCEL))
+    {
+        return COMMAND_STREAM_CANCEL;
+    }
+    if(isControlFrame(content, length, METRIC_ACK))
+    {
+        return COMMAND_METRIC_ACK;
+    }
+    if(isExactly(content, length, START_REQUEST))
+    {
+        return COMMAND_START;
+    }
+    if(isExactly(content, length, STOP_REQUEST))
+    {
+        return COMMAND_STOP;
+    }
+    if(isExactly(content, length, STREAM_LOG_REQUEST))
+    {
+        return COMMAND_LOG;
+    }
+    if(isExactly(content, length, STREAM_TABLE_REQUEST))
+    {
+        return COMMAND_TABLE;
+    }
+    if(isExactly(content, length, MEMORY_REQUEST))
+    {
+        return COMMAND_MEMORY;
+    }
+    if(isControlFrame(content, length, METRIC_SUBSCRIBE))
+    {
+        return COMMAND_SUBSCRIBE;
+    }
+    if(isExactly(content, length, FLEET_REQUEST))
+    {
+        return COMMAND_FLEET;
+    }
+    return COMMAND_OTHER;
+}
+
+static bool isReplyWord(const char *content, size_t length, const char *word) __attribute__((pure));
+
+static bool isReplyWord(const char *content, size_t length, const char *word)
+{
+    /**
+     * Check if content is word, optionally followed by a newline
+     */
+    size_t wordLength = strlen(word);
+
+    if(length == wordLength + 1 && content[wordLength] == '\n')
+    {
+        length = wordLength;
+    }
+    return isExactly(content, length, word);
+}
+
+Reply classifyReply(const char *content, size_t length)
+{
+    /**
+     * Work out what kind of server frame the manager received, in the order the listener handles them
+     */
+    if(isControlFrame(content, length, HEARTBEAT_PING) || isControlFrame(content, length, HEARTBEAT_PONG))
+    {
+        return REPLY_HEARTBEAT;
+    }
+    if(isControlFrame(content, length, STATE_EVENT))
+    {
+        return REPLY_STATE_EVENT;
+    }
+    if(isControlFrame(content, length, STREAM_BEGIN) || isControlFrame(content, length, STREAM_CHUNK) || isControlFrame(content, length, STREAM_END) || isControlFrame(content, length, STREAM_REPLY))
+    {
+        return REPLY_STREAM;
+    }
+    if(isReplyWord(content, length, STATE_STOPPED))
+    {
+        return REPLY_STOPPED;
+    }
+    if(isReplyWord(content, length, STATE_STARTED))
+    {
+        return REPLY_STARTED;
+    }
+    if(isReplyWord(content, length, "ACCEPTED"))
+    {
+        return REPLY_ACCEPTED;
+    }
+    if(isControlFrame(content, length, METRIC_UPDATE))
+    {
+        return REPLY_METRICS;
+    }
+    return REPLY_OTHER;
+}
+
+static const char *const metricNames[METRIC_COUNT] = {"connections", "managers", "running", "state_version", "frames_received", "bytes_buffered", "bytes_pooled", "uptime_s"};
+
+const char *metricName(Metric metric)
+{
+    return metric < METRIC_COUNT ? metricNames[metric] : "?";
+}
+
+bool parseMetricNames(const char *list, uint32_t *mask)
+{
+    /**
+     * Turn "all" or a comma separated list of metric names into a subscription mask
+     * Return False if a name is unknown
+     */
+    *mask = 0;
+    if(strcmp(list, "all") == 0)
+    {
+        *mask = METRIC_ALL;
+        return true;
+    }
+
+    while(*list != '\0')
+    {
+        size_t length = strcspn(list, ",");
+        bool   found  = false;
+
+        for(int metric = 0; metric < METRIC_COUNT; metric++)
+        {
+            if(strlen(metricNames[metric]) == length && strncmp(list, metricNames[metric], length) == 0)
+            {
+                *mask |= 1U << metric;
+                found = true;
+            }
+        }
+        if(!found)
+        {
+            return false;
+        }
+        list += length;
+        if(*list == ',')
+        {
+            list++;
+        }
+    }
+    return *mask != 0;
+}
+
+size_t encodeVarint(uint8_t *buffer, size_t capacity, uint64_t value)
+{
+    /**
+     * Write value 7 bits at a time, low bits first, the top bit of each byte marking that more follow
+     * Return the number of bytes written, 0 if they do not fit
+     */
+    size_t used = 0;
+
+    do
+    {
+        uint8_t byte = value & VARINT_PAYLOAD;
+
+        value >>= VARINT_SHIFT;
+        if(used == capacity)
+        {
+            return 0;
+        }
+        buffer[used++] = value != 0 ? (uint8_t)(byte | VARINT_CONTINUE) : byte;
+    } while(value != 0);
+    return used;
+}
+
+size_t decodeVarint(const uint8_t *buffer, size_t length, uint64_t *value)
+{
+    /**
+     * Read a varint written by encodeVarint
+     * Return the number of bytes it occupied, 0 if it is truncated or too long for 64 bits
+     */
+    uint64_t result = 0;
+
+    for(size_t i = 0; i < length && i < VARINT_MAX_BYTES; i++)
+    {
+        result |= (uint64_t)(buffer[i] & VARINT_PAYLOAD) << (i * VARINT_SHIFT);
+        if((buffer[i] & VARINT_CONTINUE) == 0)
+        {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+static uint64_t zigzagEncode(int64_t value)
+{
+    // Small negative deltas stay small: 0, -1, 1, -2, ... become 0, 1, 2, 3, ...
+    return ((uint64_t)value << 1) ^ (value < 0 ? UINT64_MAX : 0);
+}
+
+static int64_t zigzagDecode(uint64_t value)
+{
+    return (int64_t)((value >> 1) ^ (~(value & 1) + 1));
+}
+
+uint32_t changedMetrics(const int64_t *values, const int64_t *base, uint32_t mask)
+{
+    /**
+     * Pick the metrics of mask whose value differs from the base snapshot
+     */
+    uint32_t changed = 0;
+
+    for(int metric = 0; metric < METRIC_COUNT; metric++)
+    {
+        if((mask & (1U << metric)) != 0 && values[metric] != base[metric])
+        {
+            changed |= 1U << metric;
+        }
+    }
+    return changed;
+}
+
+size_t encodeMetricUpdate(char *buffer, size_t capacity, uint64_t seq, const int64_t *values, const int64_t *base, uint64_t baseSeq, uint32_t mask)
+{
+    /**
+     * Encode the metrics of mask as deltas from base, or from zero for a keyframe (base NULL, baseSeq 0)
+     * Return the content length, 0 if it does not fit
+     */
+    uint8_t *out    = (uint8_t *)buffer;
+    size_t   prefix = strlen(METRIC_UPDATE);
+    size_t   used   = prefix + 1;
+    size_t   written;
+
+    if(capacity < used)
+    {
+        return 0;
+    }
+    memcpy(buffer, METRIC_UPDATE, prefix);
+    buffer[prefix] = ' ';
+
+    if((written = encodeVarint(out + used, capacity - used, seq)) == 0)
+    {
+        return 0;
+    }
+    used += written;
+    if((written = encodeVarint(out + used, capacity - used, baseSeq)) == 0)
+    {
+        return 0;
+    }
+    used += written;
+    if((written = encodeVarint(out + used, capacity - used, mask)) == 0)
+    {
+        return 0;
+    }
+    used += written;
+
+    for(int metric = 0; metric < METRIC_COUNT; metric++)
+    {
+        if((mask & (1U << metric)) != 0)
+        {
+            uint64_t from  = base != NULL ? (uint64_t)base[metric] : 0;
+            int64_t  delta = (int64_t)((uint64_t)values[metric] - from);
+
+            if((written = encodeVarint(out + used, capacity - used, zigzagEncode(delta))) == 0)
+            {
+                return 0;
+            }
+            used += written;
+        }
+    }
+    return used;
+}
+
+bool decodeMetricUpdate(const char *content, size_t length, MetricUpdate *update)
+{
+    /**
+     * Parse an update frame without applying it
+     * Return False if it is malformed or names metrics this build does not know
+     */
+    const uint8_t *in     = (const uint8_t *)content;
+    size_t         offset = strlen(METRIC_UPDATE) + 1;
+    size_t         read;
+    uint64_t       mask;
+
+    if(length < offset || !isControlFrame(content, length, METRIC_UPDATE))
+    {
+        return false;
+    }
+    if((read = decodeVarint(in + offset, length - offset, &update->seq)) == 0)
+    {
+        return false;
+    }
+    offset += read;
+    if((read = decodeVarint(in + offset, length - offset, &update->baseSeq)) == 0)
+    {
+        return false;
+    }
+    offset += read;
+    if((read = decodeVarint(in + offset, length - offset, &mask)) == 0 || (mask & ~(uint64_t)METRIC_ALL) != 0)
+    {
+        return false;
+    }
+    offset += read;
+    update->mask = (uint32_t)mask;
+
+    for(int metric = 0; metric < METRIC_COUNT; metric++)
+    {
+        uint64_t encoded = 0;
+
+        if((update->mask & (1U << metric)) != 0)
+        {
+            if((read = decodeVarint(in + offset, length - offset, &encoded)) == 0)
+            {
+                return false;
+            }
+            offset += read;
+        }
+        update->deltas[metric] = zigzagDecode(encoded);
+    }
+    return offset == length;
+}
+
+void applyMetricUpdate(const MetricUpdate *update, int64_t *values)
+{
+    /**
+     * Bring a snapshot up to date, values must hold snapshot baseSeq unless the update is a keyframe
+     */
+    for(int metric = 0; metric < METRIC_COUNT; metric++)
+    {
+        if((update->mask & (1U << metric)) != 0)
+        {
+            uint64_t from = update->baseSeq != 0 ? (uint64_t)values[metric] : 0;
+
+            values[metric] = (int64_t)(from + (uint64_t)update->deltas[metric]);
+        }
+    }
+}
+
+void subscriptionConfigure(Subscription *subscription, uint32_t mask, uint64_t intervalMs)
+{
+    /**
+     * Set what a subscriber wants and how often, every change starts over with a keyframe
+     * The sequence carries on so acks for updates sent before the change are simply ignored
+     */
+    subscription->mask           = mask & METRIC_ALL;
+    subscription->intervalMs     = intervalMs < METRIC_MIN_INTERVAL_MS ? METRIC_MIN_INTERVAL_MS : (intervalMs > UINT32_MAX ? UINT32_MAX : (uint32_t)intervalMs);
+    subscription->nextUpdateMs   = 0;
+    subscription->nextKeyframeMs = 0;
+}
+
+bool subscriptionDue(const Subscription *subscription, uint64_t nowMs)
+{
+    /**
+     * A keyframe is due on schedule regardless of acks, a delta only once the previous update was acknowledged
+     */
+    return nowMs >= subscription->nextKeyframeMs || (nowMs >= subscription->nextUpdateMs && subscription->pendingSeq == 0);
+}
+
+size_t subscriptionUpdate(Subscription *subscription, const int64_t *values, uint64_t nowMs, char *buffer, size_t capacity)
+{
+    /**
+     * Encode the subscribed metrics that changed since the snapshot the subscriber last acknowledged
+     * Only one delta is in flight at a time so its base is always the subscriber's current snapshot
+     * Return the encoded length, 0 when nothing is due or nothing changed
+     */
+    bool     keyframe = nowMs >= subscription->nextKeyframeMs;
+    uint32_t mask     = subscription->mask;
+    size_t   length;
+
+    if(!subscriptionDue(subscription, nowMs))
+    {
+        return 0;
+    }
+
+    subscription->nextUpdateMs = nowMs + subscription->intervalMs;
+    if(keyframe)
+    {
+        subscription->nextKeyframeMs = nowMs + METRIC_KEYFRAME_MS;
+    }
+    else
+    {
+        mask = changedMetrics(values, subscription->acked, mask);
+        if(mask == 0)
+        {
+            return 0;
+        }
+    }
+
+    length = encodeMetricUpdate(buffer, capacity, subscription->lastSeq + 1, values, keyframe ? NULL : subscription->acked, keyframe ? 0 : subscription->ackedSeq, mask);
+    if(length > 0)
+    {
+        subscription->lastSeq++;
+        subscription->pendingSeq = subscription->lastSeq;
+        memcpy(subscription->pending, values, sizeof(subscription->pending));
+    }
+    return length;
+}
+
+void subscriptionOnAck(Subscription *subscription, uint64_t seq)
+{
+    /**
+     * Adopt the acknowledged update as the base of the next delta, stale acks are ignored
+     */
+    if(seq != 0 && seq == subscription->pendingSeq)
+    {
+        memcpy(subscription->acked, subscription->pending, sizeof(subscription->acked));
+        subscription->ackedSeq   = seq;
+        subscription->pendingSeq = 0;
+    }
+}
+
+uint64_t subscriptionNextEvent(const Subscription *subscription)
+{
+    /**
+     * The earliest time the subscription needs attention
+     * While a delta waits for its ack only the keyframe can make anything due
+     */
+    if(subscription->pendingSeq == 0 && subscription->nextUpdateMs < subscription->nextKeyframeMs)
+    {
+        return subscription->nextUpdateMs;
+    }
+    return subscription->nextKeyframeMs;
+}
+
+void heartbeatInit(Heartbeat *heartbeat, uint32_t intervalMs, uint32_t maxMisses, uint64_t nowMs)
+{
+    /**
+     * Start tracking a freshly connected peer
+     */
+    memset(heartbeat, 0, sizeof(*heartbeat));
+    heartbeat->intervalMs     = intervalMs;
+    heartbeat->maxMisses      = maxMisses;
+    heartbeat->lastReceivedMs = nowMs;
+    heartbeat->nextPingMs     = nowMs + intervalMs;
+}
+
+void heartbeatOnReceive(Heartbeat *heartbeat, uint64_t nowMs)
+{
+    /**
+     * Record that the peer sent something
+     */
+    heartbeat->lastReceivedMs = nowMs;
+}
+
+void heartbeatOnPing(Heartbeat *heartbeat, uint64_t nowMs)
+{
+    /**
+     * Record that a ping was sent and schedule the next one
+     */
+    heartbeat->nextPingMs = nowMs + heartbeat->intervalMs;
+}
+
+void heartbeatOnPong(Heartbeat *heartbeat, uint64_t sentUs, uint64_t nowUs)
+{
+    /**
+     * Fold the round trip of an answered ping into the RTT estimate
+     */
+    RttStats *rtt = &heartbeat->rtt;
+    uint64_t  sample;
+
+    if(nowUs < sentUs)
+    {
+        return;
+    }
+
+    sample      = nowUs - sentUs;
+    rtt->lastUs = sample;
+    if(rtt->samples == 0)
+    {
+        rtt->smoothedUs = sample;
+        rtt->minUs      = sample;
+        rtt->maxUs      = sample;
+    }
+    else
+    {
+        rtt->smoothedUs = rtt->smoothedUs - (rtt->smoothedUs >> RTT_GAIN_SHIFT) + (sample >> RTT_GAIN_SHIFT);
+        if(sample < rtt->minUs)
+        {
+            rtt->minUs = sample;
+        }
+        if(sample > rtt->maxUs)
+        {
+            rtt->maxUs = sample;
+        }
+    }
+    rtt->samples++;
+}
+
+bool heartbeatPingDue(const Heartbeat *heartbeat, uint64_t nowMs)
+{
+    return nowMs >= heartbeat->nextPingMs;
+}
+
+uint64_t heartbeatDeadline(const Heartbeat *heartbeat)
+{
+    /**
+     * The time at which the peer is declared dead if nothing else arrives
+     */
+    return heartbeat->lastReceivedMs + ((uint64_t)heartbeat->intervalMs * heartbeat->maxMisses);
+}
+
+bool heartbeatExpired(const Heartbeat *heartbeat, uint64_t nowMs)
+{
+    return nowMs >= heartbeatDeadline(heartbeat);
+}
+
+uint64_t heartbeatNextEvent(const Heartbeat *heartbeat)
+{
+    /**
+     * The earliest time the heartbeat needs attention (next ping or the dead-peer deadline)
+     */
+    uint64_t deadline = heartbeatDeadline(heartbeat);
+
+    return heartbeat->nextPingMs < deadline ? heartbeat->nextPingMs : deadline;
+}
@@ -1,193 +1,1020 @@
+#include "link.h"
+#include "protocol.h"
+#include "tuning.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <netinet/in.h>
-#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #define PORT 8080
-#define DIAGNOSTIC_INTERVAL 5
+#define INITIAL_CONNECTIONS 8
+#define PASSWORD "password"
+#define CONTROL_BUFFER_SIZE 64                                    // Ping, pong and diagnostic frames
+#define MILLISECONDS_PER_SECOND 1000
+#define DECIMAL 10
+#define LOG_PATH "server.log"
+#define TABLE_TEMPLATE "/tmp/server-connections-XXXXXX"
+#define TARGET_CONNECTIONS 10000                                  // Warn at startup when the descriptor limit cannot hold this many
+#define RESERVED_DESCRIPTORS 8                                    // Standard streams, listening socket, log file and streamed files
+
+#ifndef SOCK_CLOEXEC
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wunused-macros"
+    #define SOCK_CLOEXEC 0
+    #pragma GCC diagnostic pop
+#endif
+
+#ifndef MSG_MORE
+    #define MSG_MORE 0
+#endif
+
+typedef struct
+{
+    int      fd;                  // File being streamed
+    uint32_t id;
+    off_t    offset;              // Next file byte to send
+    off_t    end;                 // File size when the stream began
+    uint32_t nextSeq;             // Chunks started so far
+    uint32_t ackedSeq;            // Chunks the manager has confirmed
+    uint8_t  header[FRAME_HEADER_SIZE + STREAM_HEADER_SIZE];
+    size_t   headerLength;        // Frame header and chunk text header of the in-flight chunk
+    size_t   headerSent;
+    size_t   payloadRemaining;    // File bytes of the in-flight chunk still to go out
+} Stream;
+
+typedef struct
+{
+    Link          link;            // Held while a file chunk is half sent, so frames queue behind it
+    bool          authenticated;
+    uint32_t      lastStreamId;
+    Stream       *stream;          // Only allocated while a download is in progress
+    Subscription *subscription;    // Only allocated while the manager wants metrics
+} Connection;
+
+typedef struct
+{
+    int            listenfd;
+    Connection   **connections;
+    size_t         count;
+    size_t         capacity;
+    struct pollfd *pollfds;
+    uint32_t       heartbeatIntervalMs;
+    uint32_t       heartbeatMaxMisses;
+    const char    *logPath;
+    uint8_t       *scratch;         // Every read lands here first, shared because the loop is single threaded
+    bool           acceptPaused;    // Out of descriptors, stop polling the listening socket until a connection closes
+    bool           running;         // Authoritative started/stopped state shared by every manager
+    uint64_t       stateVersion;    // Bumped on every change so managers can ignore stale events
+    SocketTuning   tuning;
+    uint64_t       startedMs;
+    uint64_t       framesReceived;
+    int64_t        metrics[METRIC_COUNT];    // Current snapshot, shared by every subscriber
+    bool           metricsFresh;             // Snapshot already taken during this pass of the event loop
+} Server;
 
 typedef struct
 {
-    uint8_t  version;
-    uint16_t length;
-    char    *content;
-} Packet;
+    size_t connections;
+    size_t bytesPerConnection;    // Connection table, poll slots and everything the connections hold, averaged
+    size_t bufferedBytes;         // Buffers, stream and subscription state currently held by connections
+    size_t pooledBytes;           // Drained buffers waiting in the pool
+} MemoryUsage;
+
+static FILE      *logFile = NULL;    // Everything the server prints is also appended here
 
-Packet receivePacket(int client_socket)
+static void serverLog(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+static void serverLog(const char *format, ...)
 {
-    Packet packet;
+    /**
+     * Print to stdout and append to the log file that managers can download
+     */
+    va_list args;
+
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    fflush(stdout);
 
-    // Receive version
-    if(recv(client_socket, &packet.version, sizeof(packet.version), 0) == -1)
+    if(logFile != NULL)
     {
-        perror("Receive version failed");
-        exit(EXIT_FAILURE);
+        va_start(args, format);
+        vfprintf(logFile, format, args);
+        va_end(args);
+        fflush(logFile);
     }
+}
 
-    // Receive length
-    if(recv(client_socket, &packet.length, sizeof(packet.length), 0) == -1)
+static void sendFailed(Connection *connection, const char *what)
+{
+    /**
+     * Drop the connection unless the send only failed because the socket buffer is full
+     */
+    if(!wouldBlock(errno))
     {
-        perror("Receive length failed");
-        exit(EXIT_FAILURE);
+        perror(what);
+        connection->link.closing = true;
     }
-    else
+}
+
+static bool chunkInFlight(const Stream *stream)
+{
+    return stream != NULL && (stream->headerSent < stream->headerLength || stream->payloadRemaining > 0);
+}
+
+static bool streamCanSend(const Stream *stream)
+{
+    /**
+     * Check if the next chunk may start: nothing half sent and the manager's window is open
+     */
+    return stream != NULL && !chunkInFlight(stream) && stream->offset < stream->end && stream->nextSeq - stream->ackedSeq < STREAM_WINDOW;
+}
+
+static bool wantsWrite(const Connection *connection)
+{
+    return connection->link.txLength > 0 || chunkInFlight(connection->stream) || streamCanSend(connection->stream);
+}
+
+static void startChunk(Stream *stream)
+{
+    /**
+     * Prepare the headers of the next chunk, its payload stays in the file
+     */
+    char   text[STREAM_HEADER_SIZE];
+    off_t  left    = stream->end - stream->offset;
+    size_t payload = left < STREAM_CHUNK_SIZE ? (size_t)left : STREAM_CHUNK_SIZE;
+    size_t textLength;
+
+    textLength = (size_t)formatChunkHeader(text, sizeof(text), stream->id, stream->nextSeq);
+    encodeFrameHeader(stream->header, textLength + payload);
+    memcpy(stream->header + FRAME_HEADER_SIZE, text, textLength);
+    stream->headerLength     = FRAME_HEADER_SIZE + textLength;
+    stream->headerSent       = 0;
+    stream->payloadRemaining = payload;
+    stream->nextSeq++;
+}
+
+static bool sendChunk(Connection *connection)
+{
+    /**
+     * Push the in-flight chunk: its headers from memory, then its payload straight from the file
+     * Return True once nothing of the chunk is left to send
+     */
+    Stream *stream = connection->stream;
+
+    if(stream == NULL)
     {
-        printf("Received length: %d\n", packet.length);
+        return true;
     }
 
-    // Allocate memory for content
-    packet.content = (char *)malloc(packet.length * sizeof(char));
+    while(stream->headerSent < stream->headerLength)
+    {
+        ssize_t sent = send(connection->link.fd, stream->header + stream->headerSent, stream->headerLength - stream->headerSent, MSG_NOSIGNAL | MSG_MORE);
+        if(sent == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            sendFailed(connection, "Send failed");
+            return false;
+        }
+        stream->headerSent += (size_t)sent;
+    }
 
-    // Receive content
-    if(recv(client_socket, packet.content, packet.length, 0) == -1)
+    while(stream->payloadRemaining > 0)
     {
-        perror("Receive content failed");
-        exit(EXIT_FAILURE);
+        ssize_t sent = sendfile(connection->link.fd, stream->fd, &stream->offset, stream->payloadRemaining);
+        if(sent == 0)
+        {
+            // The file shrank under us and the frame can no longer be completed
+            serverLog("Stream %" PRIu32 " to client %d ended early, closing\n", stream->id, connection->link.fd);
+            connection->link.closing = true;
+            return false;
+        }
+        if(sent == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            sendFailed(connection, "Sendfile failed");
+            return false;
+        }
+        stream->payloadRemaining -= (size_t)sent;
     }
-    else
+    connection->link.held = false;
+    return true;
+}
+
+static void finishStream(Connection *connection)
+{
+    /**
+     * Close the source file, tell the manager how many bytes were sent and drop the stream state
+     */
+    Stream *stream = connection->stream;
+    char    end[CONTROL_BUFFER_SIZE];
+    int     length;
+
+    close(stream->fd);
+    length = snprintf(end, sizeof(end), "%s %" PRIu32 " %lld", STREAM_END, stream->id, (long long)stream->offset);
+    serverLog("Stream %" PRIu32 " to client %d complete: %lld bytes in %" PRIu32 " chunks\n", stream->id, connection->link.fd, (long long)stream->offset, stream->nextSeq);
+    free(stream);
+    connection->stream = NULL;
+    linkSendPacket(&connection->link, end, (size_t)length);
+}
+
+static void cancelStream(Connection *connection)
+{
+    /**
+     * Stop a stream the manager gave up on, a chunk already on its way still goes out whole so frames never break
+     */
+    Stream *stream = connection->stream;
+
+    serverLog("Client %d cancelled stream %" PRIu32 " after %lld bytes\n", connection->link.fd, stream->id, (long long)stream->offset);
+    stream->end = stream->offset + (off_t)stream->payloadRemaining;
+    if(!chunkInFlight(stream))
     {
-        printf("Received content: %s\n", packet.content);
+        finishStream(connection);
     }
+}
 
-    return packet;
+static void flushConnection(Connection *connection)
+{
+    /**
+     * Write as much of the pending output as the socket accepts without blocking
+     * A chunk that has started always goes out whole before any queued frame so frames never interleave
+     */
+    if(!sendChunk(connection))
+    {
+        return;
+    }
+
+    linkFlush(&connection->link);
+
+    while(!connection->link.closing && connection->link.txLength == 0 && streamCanSend(connection->stream))
+    {
+        startChunk(connection->stream);
+        connection->link.held = true;
+        if(!sendChunk(connection))
+        {
+            return;
+        }
+    }
+
+    if(!connection->link.closing && connection->stream != NULL && connection->stream->offset >= connection->stream->end && !chunkInFlight(connection->stream))
+    {
+        finishStream(connection);
+    }
+}
+
+static void sendString(Connection *connection, const char *content)
+{
+    serverLog("Sending packet with content: %s\n", content);
+    linkSendPacket(&connection->link, content, strlen(content));
+}
+
+static bool contentEquals(const Packet *packet, const char *expected)
+{
+    return packet->contentLength == strlen(expected) && memcmp(packet->content, expected, packet->contentLength) == 0;
 }
 
-void *sendDiagnostic(void *arg)
+static void startStream(Connection *connection, int fd, const char *name)
 {
-    // sleep for a minute
-    int sockfd = *((int *)arg);
-    sleep(20);
+    /**
+     * Begin streaming a file to the manager, the chunks follow as the socket and the manager's window allow
+     * fd: The file to send, owned by the stream from here on
+     */
+    Stream     *stream;
+    struct stat info;
+    char        begin[CONTROL_BUFFER_SIZE];
+    int         length;
 
-    while(true)
+    if(connection->stream != NULL)
     {
-        // Create and send the diagnostic packet
-        // Packet packet;
-        // packet.version = 1;
-        // packet.content = "Diagnostic data...";
-        // packet.length = strlen(packet.content);
+        close(fd);
+        sendString(connection, "STREAM BUSY");
+        return;
+    }
+    if(fstat(fd, &info) == -1)
+    {
+        perror("fstat");
+        close(fd);
+        sendString(connection, "STREAM UNAVAILABLE");
+        return;
+    }
+    stream = (Stream *)calloc(1, sizeof(*stream));
+    if(stream == NULL)
+    {
+        perror("calloc");
+        close(fd);
+        sendString(connection, "STREAM UNAVAILABLE");
+        return;
+    }
 
-        uint8_t  version_packet;
-        uint16_t content_length_packet;
+    stream->fd         = fd;
+    stream->id         = ++connection->lastStreamId;
+    stream->end        = info.st_size;
+    connection->stream = stream;
+
+    length = snprintf(begin, sizeof(begin), "%s %" PRIu32 " %lld %s", STREAM_BEGIN, stream->id, (long long)stream->end, name);
+    serverLog("Streaming %s (%lld bytes) to client %d as stream %" PRIu32 "\n", name, (long long)stream->end, connection->link.fd, stream->id);
+    linkSendPacket(&connection->link, begin, (size_t)length);
+    if(stream->end == 0)
+    {
+        // No chunk will ever ask for the socket, so the end frame goes out now
+        finishStream(connection);
+    }
+}
 
-        // Create the version packet
-        version_packet = (uint8_t)1;
-        send(sockfd, &version_packet, sizeof(version_packet), 0);
-        printf("Debug: Sending version: %d\n", version_packet);
+static size_t encodeStateEvent(const Server *server, uint8_t *frame, size_t capacity)
+{
+    /**
+     * Encode the current state as a ready-to-send event frame
+     * Return the frame length
+     */
+    char content[CONTROL_BUFFER_SIZE];
+    int  length = formatStateEvent(content, sizeof(content), server->stateVersion, server->running);
 
-        content_length_packet = htons(strlen("/d 3"));
-        send(sockfd, &content_length_packet, sizeof(content_length_packet), 0);
-        printf("Debug: Sending length: %d\n", content_length_packet);
+    return encodeFrame(frame, capacity, content, (size_t)length);
+}
 
-        // Create the content packet
-        send(sockfd, "/d 3", strlen("/d 3"), 0);
-        printf("Debug: Sending content: %s\n", "/d 3");
+static void publishState(const Server *server)
+{
+    /**
+     * Fan the new state out to every subscribed manager in one pass over the connection table
+     * The event is encoded once and the same bytes are handed to each socket
+     */
+    uint8_t frame[FRAME_HEADER_SIZE + CONTROL_BUFFER_SIZE];
+    size_t  length      = encodeStateEvent(server, frame, sizeof(frame));
+    size_t  subscribers = 0;
 
-        // Sleep for the specified interval
-        sleep(DIAGNOSTIC_INTERVAL);
+    for(size_t i = 0; i < server->count; i++)
+    {
+        Connection *connection = server->connections[i];
+        if(connection->authenticated && !connection->link.closing)
+        {
+            linkSendEncoded(&connection->link, frame, length);
+            subscribers++;
+        }
     }
-    pthread_exit(NULL);
+    serverLog("Published state %s (version %" PRIu64 ") to %zu managers\n", server->running ? STATE_STARTED : STATE_STOPPED, server->stateVersion, subscribers);
 }
 
-void sendPacket(int client_socket, char *content)
+static void changeState(Server *server, bool running)
 {
-    Packet packet;
-    packet.version = 1;
-    packet.content = content;
-    packet.length  = strlen(packet.content);
+    /**
+     * Apply a start or stop command, publishing only if the state actually changed
+     */
+    if(server->running == running)
+    {
+        return;
+    }
+    server->running = running;
+    server->stateVersion++;
+    publishState(server);
+}
 
-    printf("Sending packet with content: %s\n", packet.content);
-    printf("Sending packet with length: %d\n", packet.length);
+static void measureMemory(const Server *server, MemoryUsage *usage)
+{
+    /**
+     * Add up what the connection table costs in user space, kernel socket buffers are not included
+     */
+    size_t fixed = (server->capacity * sizeof(Connection *)) + ((server->capacity + 1) * sizeof(struct pollfd));
 
-    // Send version
-    // if (send(client_socket, &packet.version, sizeof(packet.version), 0) == -1) {
-    //     perror("Send version failed");
-    //     exit(EXIT_FAILURE);
-    // }
+    memset(usage, 0, sizeof(*usage));
+    for(size_t i = 0; i < server->count; i++)
+    {
+        const Connection *connection = server->connections[i];
 
-    // // Send length
-    // if (send(client_socket, &packet.length, sizeof(packet.length), 0) == -1) {
-    //     perror("Send length failed");
-    //     exit(EXIT_FAILURE);
-    // }
+        fixed += sizeof(Connection);
+        usage->bufferedBytes += linkBufferedBytes(&connection->link);
+        usage->bufferedBytes += (connection->stream != NULL ? sizeof(Stream) : 0) + (connection->subscription != NULL ? sizeof(Subscription) : 0);
+    }
 
-    uint8_t  version_packet;
-    uint16_t content_length_packet;
+    usage->connections        = server->count;
+    usage->bytesPerConnection = server->count > 0 ? (fixed + usage->bufferedBytes) / server->count : 0;
+    usage->pooledBytes        = linkPooledBytes();
+}
 
-    // Create the version packet
-    version_packet = (uint8_t)1;
-    send(client_socket, &version_packet, sizeof(version_packet), 0);
-    printf("Debug: Sending version: %d\n", version_packet);
+static int writeConnectionTable(const Server *server)
+{
+    /**
+     * Dump the connection table into an unlinked temporary file so it can be streamed like the log
+     * Return the file descriptor, -1 on failure
+     */
+    char        path[] = TABLE_TEMPLATE;
+    int         fd     = mkstemp(path);
+    MemoryUsage usage;
 
-    content_length_packet = htons(strlen(content));
-    send(client_socket, &content_length_packet, sizeof(content_length_packet), 0);
-    printf("Debug: Sending length: %d\n", content_length_packet);
+    if(fd == -1)
+    {
+        perror("mkstemp");
+        return -1;
+    }
+    unlink(path);
 
-    // Send content
-    if(send(client_socket, packet.content, packet.length, 0) == -1)
+    measureMemory(server, &usage);
+    dprintf(fd, "# %zu connections, %zu bytes per connection, %zu bytes buffered, %zu bytes pooled\n", usage.connections, usage.bytesPerConnection, usage.bufferedBytes, usage.pooledBytes);
+    dprintf(fd, "%-6s %-14s %-12s %-12s %-12s %-10s\n", "fd", "authenticated", "srtt_us", "min_us", "max_us", "pending_tx");
+    for(size_t i = 0; i < server->count; i++)
     {
-        perror("Send content failed");
-        exit(EXIT_FAILURE);
+        const Connection *connection = server->connections[i];
+        const RttStats   *rtt        = &connection->link.heartbeat.rtt;
+        dprintf(fd, "%-6d %-14s %-12" PRIu64 " %-12" PRIu64 " %-12" PRIu64 " %-10zu\n", connection->link.fd, connection->authenticated ? "yes" : "no", rtt->smoothedUs, rtt->minUs, rtt->maxUs, connection->link.txLength);
     }
+    return fd;
 }
 
-void handleClient(int client_socket)
+static void refreshMetrics(Server *server, uint64_t nowMs)
 {
-    Packet packet;
+    /**
+     * Take the metric snapshot at most once per pass of the event loop, however many managers subscribe
+     */
+    MemoryUsage usage;
+    int64_t     managers = 0;
 
-    // Receive password packet
-    packet         = receivePacket(client_socket);
-    char *password = packet.content;
-    if(strcmp(password, "password") != 0)
+    if(server->metricsFresh)
     {
-        sendPacket(client_socket, "DENIED");
+        return;
     }
-    else
+
+    for(size_t i = 0; i < server->count; i++)
     {
-        sendPacket(client_socket, "ACCEPTED");
+        managers += server->connections[i]->authenticated ? 1 : 0;
     }
+    measureMemory(server, &usage);
 
-    int       sockfd = client_socket;
-    pthread_t diagnostic_thread;
-    pthread_create(&diagnostic_thread, NULL, sendDiagnostic, &sockfd);
+    server->metrics[METRIC_CONNECTIONS]     = (int64_t)server->count;
+    server->metrics[METRIC_MANAGERS]        = managers;
+    server->metrics[METRIC_RUNNING]         = server->running ? 1 : 0;
+    server->metrics[METRIC_STATE_VERSION]   = (int64_t)server->stateVersion;
+    server->metrics[METRIC_FRAMES_RECEIVED] = (int64_t)server->framesReceived;
+    server->metrics[METRIC_BYTES_BUFFERED]  = (int64_t)usage.bufferedBytes;
+    server->metrics[METRIC_BYTES_POOLED]    = (int64_t)usage.pooledBytes;
+    server->metrics[METRIC_UPTIME_SECONDS]  = (int64_t)((nowMs - server->startedMs) / MILLISECONDS_PER_SECOND);
+    server->metricsFresh                    = true;
+}
 
-    while(1)
+static void subscribe(Connection *connection, uint64_t mask, uint64_t intervalMs)
+{
+    /**
+     * Start, change or (with an empty mask) end a manager's metric subscription
+     */
+    Subscription *subscription = connection->subscription;
+
+    if((mask & METRIC_ALL) == 0)
+    {
+        free(subscription);
+        connection->subscription = NULL;
+        serverLog("Client %d unsubscribed from metrics\n", connection->link.fd);
+        return;
+    }
+
+    if(subscription == NULL)
+    {
+        subscription = (Subscription *)calloc(1, sizeof(*subscription));
+        if(subscription == NULL)
+        {
+            perror("calloc");
+            return;
+        }
+        connection->subscription = subscription;
+    }
+
+    subscriptionConfigure(subscription, (uint32_t)(mask & METRIC_ALL), intervalMs);
+    serverLog("Client %d subscribed to metrics 0x%" PRIx32 " every %" PRIu32 " ms\n", connection->link.fd, subscription->mask, subscription->intervalMs);
+}
+
+static void sendMetrics(Server *server, Connection *connection, uint64_t nowMs)
+{
+    /**
+     * Push the subscribed metrics that changed, the snapshot is only taken when an update is actually due
+     */
+    char   update[METRIC_UPDATE_SIZE];
+    size_t length;
+
+    if(!subscriptionDue(connection->subscription, nowMs))
+    {
+        return;
+    }
+    refreshMetrics(server, nowMs);
+    length = subscriptionUpdate(connection->subscription, server->metrics, nowMs, update, sizeof(update));
+    if(length > 0)
     {
-        // Receive message packet
-        printf("Waiting for command...\n");
-        packet = receivePacket(client_socket);
-        if(strcmp(packet.content, "/s") == 0)
+        linkSendPacket(&connection->link, update, length);
+    }
+}
+
+static void handlePacket(Server *server, Connection *connection, const Packet *packet)
+{
+    /**
+     * Act on one complete frame from a client
+     * Heartbeats are answered before authentication so an idle manager is not dropped while the operator types the password
+     */
+    Command command;
+
+    if(packet->version != CURRENT_VERSION)
+    {
+        serverLog("Dropping frame with unsupported version %d\n", packet->version);
+        return;
+    }
+
+    command = classifyCommand(packet->content, packet->contentLength);
+    if(command == COMMAND_PING)
+    {
+        char pong[CONTROL_BUFFER_SIZE];
+        int  length = formatPong(pong, sizeof(pong), packet->content, packet->contentLength);
+        if(length > 0 && (size_t)length < sizeof(pong))
         {
-            sendPacket(client_socket, "STARTED");
+            linkSendPacket(&connection->link, pong, (size_t)length);
         }
-        else if(strcmp(packet.content, "/q") == 0)
+        return;
+    }
+
+    if(command == COMMAND_PONG)
+    {
+        uint64_t sentUs;
+        if(parsePong(packet->content, packet->contentLength, &sentUs))
+        {
+            heartbeatOnPong(&connection->link.heartbeat, sentUs, monotonicMicros());
+        }
+        return;
+    }
+
+    if(command == COMMAND_METRIC_ACK)
+    {
+        uint64_t seq;
+        if(connection->subscription != NULL && parseControlNumber(packet->content, packet->contentLength, METRIC_ACK, &seq))
         {
-            sendPacket(client_socket, "STOPPED");
+            subscriptionOnAck(connection->subscription, seq);
+        }
+        return;
+    }
+
+    if(command == COMMAND_STREAM_ACK)
+    {
+        uint64_t id;
+        uint64_t received;
+        if(parseStreamNumbers(packet->content, packet->contentLength, STREAM_ACK, &id, &received) && connection->stream != NULL && id == connection->stream->id && received > connection->stream->ackedSeq && received <= connection->stream->nextSeq)
+        {
+            connection->stream->ackedSeq = (uint32_t)received;
+            flushConnection(connection);
+        }
+        return;
+    }
+
+    if(command == COMMAND_STREAM_CANCEL)
+    {
+        uint64_t id;
+        if(parseControlNumber(packet->content, packet->contentLength, STREAM_CANCEL, &id) && connection->stream != NULL && id == connection->stream->id)
+        {
+            cancelStream(connection);
+        }
+        return;
+    }
+
+    serverLog("Received content: %.*s\n", (int)packet->contentLength, packet->content);
+
+    if(!connection->authenticated)
+    {
+        if(contentEquals(packet, PASSWORD))
+        {
+            uint8_t frame[FRAME_HEADER_SIZE + CONTROL_BUFFER_SIZE];
+
+            connection->authenticated = true;
+            sendString(connection, "ACCEPTED");
+
+            // New subscribers start from the current state rather than guessing
+            linkSendEncoded(&connection->link, frame, encodeStateEvent(server, frame, sizeof(frame)));
         }
         else
         {
-            sendPacket(client_socket, "UNKNOWN COMMAND");
+            sendString(connection, "DENIED");
+        }
+        return;
+    }
+
+    switch(command)
+    {
+        case COMMAND_START:
+            sendString(connection, STATE_STARTED);
+            changeState(server, true);
+            break;
+        case COMMAND_STOP:
+            sendString(connection, STATE_STOPPED);
+            changeState(server, false);
+            break;
+        case COMMAND_LOG:
+        {
+            int fd = open(server->logPath, O_RDONLY | O_CLOEXEC);
+            if(fd == -1)
+            {
+                perror("Open log failed");
+                sendString(connection, "STREAM UNAVAILABLE");
+                return;
+            }
+            startStream(connection, fd, server->logPath);
+            break;
+        }
+        case COMMAND_TABLE:
+        {
+            int fd = writeConnectionTable(server);
+            if(fd == -1)
+            {
+                sendString(connection, "STREAM UNAVAILABLE");
+                return;
+            }
+            startStream(connection, fd, "connections");
+            break;
+        }
+        case COMMAND_SUBSCRIBE:
+        {
+            uint64_t mask;
+            uint64_t intervalMs;
+            if(parseStreamNumbers(packet->content, packet->contentLength, METRIC_SUBSCRIBE, &mask, &intervalMs))
+            {
+                subscribe(connection, mask, intervalMs);
+            }
+            break;
+        }
+        case COMMAND_MEMORY:
+        {
+            MemoryUsage usage;
+            char        reply[MEMORY_REPLY_SIZE];
+            int         length;
+
+            measureMemory(server, &usage);
+            length = snprintf(reply, sizeof(reply), "%s %zu %zu %zu %zu", MEMORY_REQUEST, usage.connections, usage.bytesPerConnection, usage.bufferedBytes, usage.pooledBytes);
+
+            serverLog("Memory: %zu connections, %zu bytes per connection, %zu bytes buffered, %zu bytes pooled\n", usage.connections, usage.bytesPerConnection, usage.bufferedBytes, usage.pooledBytes);
+            linkSendPacket(&connection->link, reply, (size_t)length);
+            break;
+        }
+        case COMMAND_PING:
+        case COMMAND_PONG:
+        case COMMAND_STREAM_ACK:
+        case COMMAND_STREAM_CANCEL:
+        case COMMAND_METRIC_ACK:
+            // Control frames are answered above, before the password check
+            break;
+        case COMMAND_FLEET:    // Only a gateway has a fleet
+        case COMMAND_OTHER:
+        default:
+            sendString(connection, "UNKNOWN COMMAND");
+            break;
+    }
+}
+
+static void receivePackets(Server *server, Connection *connection)
+{
+    /**
+     * Drain the socket and handle every complete frame that arrived
+     * Reads go to the shared scratch buffer, a connection only takes a buffer of its own to hold an incomplete frame
+     */
+    while(!connection->link.closing)
+    {
+        uint8_t *buffer;
+        size_t   offset = 0;
+        ssize_t  length;
+        Packet   packet;
+        size_t   consumed;
+
+        length = linkRead(&connection->link, server->scratch, &server->tuning, &buffer);
+        if(length == 0)
+        {
+            serverLog("Client %d disconnected\n", connection->link.fd);
+        }
+        if(length <= 0)
+        {
+            return;
+        }
+
+        while(!connection->link.closing && (consumed = decodeFrame(buffer + offset, (size_t)length - offset, &packet)) > 0)
+        {
+            server->framesReceived++;
+            handlePacket(server, connection, &packet);
+            offset += consumed;
+        }
+        linkKeepPartial(&connection->link, server->scratch, (size_t)length, offset);
+    }
+}
+
+static void runTimers(Server *server, Connection *connection, uint64_t nowMs)
+{
+    /**
+     * Declare silent peers dead, send due pings and push subscribed metrics
+     */
+    if(heartbeatExpired(&connection->link.heartbeat, nowMs))
+    {
+        serverLog("Client %d missed %" PRIu32 " heartbeats, closing\n", connection->link.fd, connection->link.heartbeat.maxMisses);
+        connection->link.closing = true;
+        return;
+    }
+
+    if(heartbeatPingDue(&connection->link.heartbeat, nowMs))
+    {
+        char ping[CONTROL_BUFFER_SIZE];
+        int  length = formatPing(ping, sizeof(ping), monotonicMicros());
+        linkSendPacket(&connection->link, ping, (size_t)length);
+        heartbeatOnPing(&connection->link.heartbeat, nowMs);
+    }
+
+    if(connection->subscription != NULL)
+    {
+        sendMetrics(server, connection, nowMs);
+    }
+}
+
+static uint64_t nextTimer(const Connection *connection)
+{
+    uint64_t next = heartbeatNextEvent(&connection->link.heartbeat);
+
+    if(connection->subscription != NULL && subscriptionNextEvent(connection->subscription) < next)
+    {
+        next = subscriptionNextEvent(connection->subscription);
+    }
+    return next;
+}
+
+static void closeConnection(Connection *connection)
+{
+    const RttStats *rtt = &connection->link.heartbeat.rtt;
+
+    if(rtt->samples > 0)
+    {
+        serverLog("Client %d RTT: last %" PRIu64 " us, smoothed %" PRIu64 " us, min %" PRIu64 " us, max %" PRIu64 " us\n", connection->link.fd, rtt->lastUs, rtt->smoothedUs, rtt->minUs, rtt->maxUs);
+    }
+    if(connection->stream != NULL)
+    {
+        close(connection->stream->fd);
+        free(connection->stream);
+    }
+    free(connection->subscription);
+    linkClose(&connection->link);
+    free(connection);
+}
+
+static void acceptConnections(Server *server)
+{
+    /**
+     * Accept every pending connection on the listening socket
+     */
+    while(1)
+    {
+        int         newsockfd;
+        Connection *connection;
+
+        newsockfd = accept4(server->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(newsockfd == -1)
+        {
+            if(errno == EMFILE || errno == ENFILE)
+            {
+                // The pending connection stays queued, polling for it again would only spin
+                serverLog("Out of file descriptors at %zu connections, accepting again once one closes\n", server->count);
+                server->acceptPaused = true;
+            }
+            else if(!wouldBlock(errno) && errno != EINTR)
+            {
+                perror("Accept failed");
+            }
+            return;
+        }
+
+        if(server->count == server->capacity)
+        {
+            size_t         capacity = server->capacity == 0 ? INITIAL_CONNECTIONS : server->capacity * 2;
+            Connection   **grown    = (Connection **)realloc(server->connections, capacity * sizeof(*grown));
+            struct pollfd *pollfds;
+            if(grown == NULL)
+            {
+                perror("realloc");
+                close(newsockfd);
+                return;
+            }
+            server->connections = grown;
+            pollfds             = (struct pollfd *)realloc(server->pollfds, (capacity + 1) * sizeof(*pollfds));
+            if(pollfds == NULL)
+            {
+                perror("realloc");
+                close(newsockfd);
+                return;
+            }
+            server->pollfds  = pollfds;
+            server->capacity = capacity;
+        }
+
+        // Buffers come later from the pool, an idle connection is only this structure
+        connection = (Connection *)calloc(1, sizeof(*connection));
+        if(connection == NULL)
+        {
+            perror("calloc");
+            close(newsockfd);
+            return;
+        }
+
+        // Not every option is inherited from the listening socket, so each connection gets the full profile
+        applySocketTuning(newsockfd, &server->tuning);
+        connection->link.fd = newsockfd;
+        heartbeatInit(&connection->link.heartbeat, server->heartbeatIntervalMs, server->heartbeatMaxMisses, monotonicMillis());
+        server->connections[server->count++] = connection;
+        serverLog("Client %d connected\n", newsockfd);
+    }
+}
+
+static void runServer(Server *server)
+{
+    /**
+     * Single threaded event loop: every connection is serviced from here, timers included
+     */
+    while(1)
+    {
+        uint64_t nowMs = monotonicMillis();
+        uint64_t next  = UINT64_MAX;
+        size_t   kept  = 0;
+        int      timeoutMs;
+        int      ready;
+
+        server->metricsFresh = false;
+        for(size_t i = 0; i < server->count; i++)
+        {
+            Connection *connection = server->connections[i];
+            if(!connection->link.closing)
+            {
+                runTimers(server, connection, nowMs);
+            }
+            if(connection->link.closing)
+            {
+                closeConnection(connection);
+                server->acceptPaused = false;
+                continue;
+            }
+            if(nextTimer(connection) < next)
+            {
+                next = nextTimer(connection);
+            }
+            server->connections[kept++] = connection;
         }
+        server->count = kept;
+
+        server->pollfds[0].fd     = server->listenfd;
+        server->pollfds[0].events = server->acceptPaused ? 0 : POLLIN;
+        for(size_t i = 0; i < server->count; i++)
+        {
+            server->pollfds[i + 1].fd     = server->connections[i]->link.fd;
+            server->pollfds[i + 1].events = (short)(POLLIN | (wantsWrite(server->connections[i]) ? POLLOUT : 0));
+        }
+
+        timeoutMs = next == UINT64_MAX ? -1 : (next <= nowMs ? 0 : (int)(next - nowMs));
+        ready     = poll(server->pollfds, server->count + 1, timeoutMs);
+        if(ready == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            perror("Poll failed");
+            exit(EXIT_FAILURE);
+        }
+
+        for(size_t i = 0; i < server->count; i++)
+        {
+            Connection *connection = server->connections[i];
+            short       revents    = server->pollfds[i + 1].revents;
+
+            if(revents & POLLOUT)
+            {
+                flushConnection(connection);
+            }
+            if(revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                receivePackets(server, connection);
+            }
+        }
+
+        if(server->pollfds[0].revents & POLLIN)
+        {
+            acceptConnections(server);
+        }
+    }
+}
+
+static void reportDescriptorLimit(void)
+{
+    /**
+     * Raise the open file limit as far as allowed and say how many connections fit
+     */
+    uint64_t soft;
+    uint64_t hard;
+
+    if(!raiseDescriptorLimit(&soft, &hard))
+    {
+        perror("getrlimit");
+        return;
+    }
+    serverLog("Open file limit %" PRIu64 " (hard %" PRIu64 "), room for about %" PRIu64 " connections\n", soft, hard, soft > RESERVED_DESCRIPTORS ? soft - RESERVED_DESCRIPTORS : 0);
+    if(soft < TARGET_CONNECTIONS + RESERVED_DESCRIPTORS)
+    {
+        serverLog("Warning: raise the hard open file limit (ulimit -Hn) to hold %d connections\n", TARGET_CONNECTIONS);
+    }
+}
+
+static uint32_t parseOption(const char *value, const char *name)
+{
+    char *endPtr;
+    long  parsed = strtol(value, &endPtr, DECIMAL);
+
+    if(endPtr == value || *endPtr != '\0' || parsed <= 0 || parsed > INT32_MAX)
+    {
+        fprintf(stderr, "Invalid %s: %s\n", name, value);
+        exit(EXIT_FAILURE);
     }
+    return (uint32_t)parsed;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
-    int                sockfd, newsockfd;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t          client_len;
+    int                sockfd;
+    int                option;
+    int                rejected;
+    struct sockaddr_in server_addr;
+    Server             server;
+    char               description[TUNING_DESCRIPTION_SIZE];
+
+    memset(&server, 0, sizeof(server));
+    server.heartbeatIntervalMs = HEARTBEAT_INTERVAL_MS;
+    server.heartbeatMaxMisses  = HEARTBEAT_MAX_MISSES;
+    server.logPath             = LOG_PATH;
+    server.startedMs           = monotonicMillis();
+    findTuningProfile(TUNING_DEFAULT_PROFILE, &server.tuning);
+
+    while((option = getopt(argc, argv, "i:m:l:p:c:")) != -1)
+    {
+        switch(option)
+        {
+            case 'i':
+                server.heartbeatIntervalMs = parseOption(optarg, "heartbeat interval");
+                break;
+            case 'm':
+                server.heartbeatMaxMisses = parseOption(optarg, "heartbeat miss count");
+                break;
+            case 'l':
+                server.logPath = optarg;
+                break;
+            case 'p':
+                if(!findTuningProfile(optarg, &server.tuning))
+                {
+                    listTuningProfiles(description, sizeof(description));
+                    fprintf(stderr, "Unknown socket profile %s, expected one of: %s\n", optarg, description);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                if(!loadTuningFile(optarg, &server.tuning))
+                {
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-i heartbeat interval ms] [-m missed heartbeats before disconnect] [-l log file] [-p socket profile] [-c socket tuning file]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    // A manager vanishing mid-write must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    logFile = fopen(server.logPath, "a");
+    if(logFile == NULL)
+    {
+        perror("Open log failed");
+    }
 
     // Create socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if(sockfd == -1)
     {
         perror("Socket creation failed");
         exit(EXIT_FAILURE);
     }
 
+    rejected = applySocketTuning(sockfd, &server.tuning);
+    if(rejected > 0)
+    {
+        fprintf(stderr, "Warning: the kernel rejected %d socket options of profile %s\n", rejected, server.tuning.name);
+    }
+
     // Set up server address
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family      = AF_INET;
@@ -202,34 +1029,36 @@ int main()
     }
 
     // Listen for connections
-    if(listen(sockfd, 5) == -1)
+    if(listen(sockfd, server.tuning.backlog == TUNING_UNSET ? SOMAXCONN : server.tuning.backlog) == -1)
     {
         perror("Listen failed");
         exit(EXIT_FAILURE);
     }
 
-    printf("Server listening on port %d...\n", PORT);
-
-    while(1)
+    server.listenfd = sockfd;
+    server.pollfds  = (struct pollfd *)malloc(sizeof(*server.pollfds));
+    server.scratch  = (uint8_t *)malloc(LINK_BUFFER_SIZE);
+    if(server.pollfds == NULL || server.scratch == NULL)
     {
-        // Accept incoming connection
-        client_len = sizeof(client_addr);
-        newsockfd  = accept(sockfd, (struct sockaddr *)&client_addr, &client_len);
-        if(newsockfd == -1)
-        {
-            perror("Accept failed");
-            exit(EXIT_FAILURE);
-        }
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
 
-        // Handle client request
-        handleClient(newsockfd);
+    serverLog("Server listening on port %d...\n", PORT);
+    describeSocketTuning(sockfd, &server.tuning, description, sizeof(description));
+    serverLog("Socket tuning %s\n", description);
+    serverLog("Heartbeat every %" PRIu32 " ms, clients dropped after %" PRIu64 " ms of silence\n", server.heartbeatIntervalMs, (uint64_t)server.heartbeatIntervalMs * server.heartbeatMaxMisses);
+    reportDescriptorLimit();
+    serverLog("An idle connection costs %zu bytes, buffers of %d bytes are pooled while traffic is in flight\n", sizeof(Connection) + sizeof(Connection *) + sizeof(struct pollfd), LINK_BUFFER_SIZE);
 
-        // Close client socket
-        close(newsockfd);
-    }
+    runServer(&server);
 
     // Close server socket
     close(sockfd);
+    if(logFile != NULL)
+    {
+        fclose(logFile);
+    }
 
     return 0;
 }
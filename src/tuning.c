@@ -0,0 +1,362 @@
+#include "tuning.h"
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define DECIMAL 10
+#define LINE_LENGTH 256
+#define KEY_LENGTH 64
+#define SOMAXCONN_PATH "/proc/sys/net/core/somaxconn"
+
+// clang-format off
+static const SocketTuning profiles[] = {
+    // name            nodelay       quickack      busy poll     sndbuf        rcvbuf        notsent lowat keepalive     idle          interval      count         backlog
+    {"default",       TUNING_UNSET, TUNING_UNSET, TUNING_UNSET, TUNING_UNSET, TUNING_UNSET, TUNING_UNSET, TUNING_UNSET, TUNING_UNSET, TUNING_UNSET, TUNING_UNSET, 5},
+    {"low-latency",   1,            1,            50,           TUNING_UNSET, TUNING_UNSET, TUNING_UNSET, 1,            10,           5,            3,            128},
+    {"high-fan-out",  1,            TUNING_UNSET, TUNING_UNSET, 4194304,      TUNING_UNSET, 16384,        1,            30,           10,           3,            4096},
+};
+// clang-format on
+
+bool findTuningProfile(const char *name, SocketTuning *tuning)
+{
+    /**
+     * Look up a named profile
+     * Return True and fill tuning if the profile exists
+     */
+    for(size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+    {
+        if(strcmp(profiles[i].name, name) == 0)
+        {
+            *tuning = profiles[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+static void appendText(char *buffer, size_t capacity, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+static void appendText(char *buffer, size_t capacity, const char *format, ...)
+{
+    /**
+     * Append formatted text to the string in buffer, silently stopping at the end of the buffer
+     */
+    size_t  used = strlen(buffer);
+    va_list args;
+
+    if(used + 1 >= capacity)
+    {
+        return;
+    }
+    va_start(args, format);
+    vsnprintf(buffer + used, capacity - used, format, args);
+    va_end(args);
+}
+
+void listTuningProfiles(char *buffer, size_t capacity)
+{
+    /**
+     * Write the profile names, separated by commas, for usage messages
+     */
+    buffer[0] = '\0';
+    for(size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+    {
+        appendText(buffer, capacity, "%s%s", i == 0 ? "" : ", ", profiles[i].name);
+    }
+}
+
+static int *tuningField(SocketTuning *tuning, const char *key)
+{
+    /**
+     * Map a configuration file key to the setting it controls
+     */
+    if(strcmp(key, "nodelay") == 0)
+    {
+        return &tuning->noDelay;
+    }
+    if(strcmp(key, "quickack") == 0)
+    {
+        return &tuning->quickAck;
+    }
+    if(strcmp(key, "busy_poll_us") == 0)
+    {
+        return &tuning->busyPollUs;
+    }
+    if(strcmp(key, "send_buffer") == 0)
+    {
+        return &tuning->sendBuffer;
+    }
+    if(strcmp(key, "receive_buffer") == 0)
+    {
+        return &tuning->receiveBuffer;
+    }
+    if(strcmp(key, "notsent_lowat") == 0)
+    {
+        return &tuning->notSentLowat;
+    }
+    if(strcmp(key, "keepalive") == 0)
+    {
+        return &tuning->keepAlive;
+    }
+    if(strcmp(key, "keepalive_idle") == 0)
+    {
+        return &tuning->keepAliveIdle;
+    }
+    if(strcmp(key, "keepalive_interval") == 0)
+    {
+        return &tuning->keepAliveInterval;
+    }
+    if(strcmp(key, "keepalive_count") == 0)
+    {
+        return &tuning->keepAliveCount;
+    }
+    if(strcmp(key, "backlog") == 0)
+    {
+        return &tuning->backlog;
+    }
+    return NULL;
+}
+
+bool loadTuningFile(const char *path, SocketTuning *tuning)
+{
+    /**
+     * Read "key = value" lines on top of the current settings
+     * "profile = <name>" starts over from that profile, later lines override it
+     * Blank lines and lines starting with # are ignored
+     * Return False (after printing the reason to stderr) if the file cannot be used
+     */
+    FILE *file = fopen(path, "r");
+    char  line[LINE_LENGTH];
+    int   lineNumber = 0;
+
+    if(file == NULL)
+    {
+        perror(path);
+        return false;
+    }
+
+    while(fgets(line, sizeof(line), file) != NULL)
+    {
+        char  key[KEY_LENGTH];
+        char  value[KEY_LENGTH];
+        char *endPtr;
+        long  parsed;
+        int  *field;
+
+        lineNumber++;
+        if(sscanf(line, " %63[^= \t\n] = %63s", key, value) != 2)
+        {
+            if(sscanf(line, " %63s", key) == 1 && key[0] != '#')
+            {
+                fprintf(stderr, "%s:%d: expected key = value\n", path, lineNumber);
+                fclose(file);
+                return false;
+            }
+            continue;
+        }
+        if(key[0] == '#')
+        {
+            continue;
+        }
+
+        if(strcmp(key, "profile") == 0)
+        {
+            if(!findTuningProfile(value, tuning))
+            {
+                fprintf(stderr, "%s:%d: unknown profile %s\n", path, lineNumber, value);
+                fclose(file);
+                return false;
+            }
+            continue;
+        }
+
+        field  = tuningField(tuning, key);
+        parsed = strtol(value, &endPtr, DECIMAL);
+        if(field == NULL || endPtr == value || *endPtr != '\0' || parsed < TUNING_UNSET || parsed > INT32_MAX)
+        {
+            fprintf(stderr, "%s:%d: invalid setting %s = %s\n", path, lineNumber, key, value);
+            fclose(file);
+            return false;
+        }
+        *field = (int)parsed;
+    }
+
+    fclose(file);
+    return true;
+}
+
+static int setOption(int sockfd, int level, int name, int value)
+{
+    /**
+     * Set one integer socket option unless the profile leaves it alone
+     * Return 1 if the kernel rejected it, 0 otherwise
+     */
+    if(value == TUNING_UNSET)
+    {
+        return 0;
+    }
+    return setsockopt(sockfd, level, name, &value, sizeof(value)) == -1 ? 1 : 0;
+}
+
+int applySocketTuning(int sockfd, const SocketTuning *tuning)
+{
+    /**
+     * Apply every setting of the profile to a socket
+     * Options the platform does not have are skipped
+     * Return the number of options the kernel rejected
+     */
+    int rejected = 0;
+
+    rejected += setOption(sockfd, IPPROTO_TCP, TCP_NODELAY, tuning->noDelay);
+    rejected += setOption(sockfd, SOL_SOCKET, SO_SNDBUF, tuning->sendBuffer);
+    rejected += setOption(sockfd, SOL_SOCKET, SO_RCVBUF, tuning->receiveBuffer);
+    rejected += setOption(sockfd, SOL_SOCKET, SO_KEEPALIVE, tuning->keepAlive);
+#ifdef TCP_QUICKACK
+    rejected += setOption(sockfd, IPPROTO_TCP, TCP_QUICKACK, tuning->quickAck);
+#endif
+#ifdef SO_BUSY_POLL
+    rejected += setOption(sockfd, SOL_SOCKET, SO_BUSY_POLL, tuning->busyPollUs);
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+    rejected += setOption(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, tuning->notSentLowat);
+#endif
+#ifdef TCP_KEEPIDLE
+    rejected += setOption(sockfd, IPPROTO_TCP, TCP_KEEPIDLE, tuning->keepAliveIdle);
+#endif
+#ifdef TCP_KEEPINTVL
+    rejected += setOption(sockfd, IPPROTO_TCP, TCP_KEEPINTVL, tuning->keepAliveInterval);
+#endif
+#ifdef TCP_KEEPCNT
+    rejected += setOption(sockfd, IPPROTO_TCP, TCP_KEEPCNT, tuning->keepAliveCount);
+#endif
+    return rejected;
+}
+
+void rearmQuickAck(int sockfd, const SocketTuning *tuning)
+{
+    /**
+     * The kernel clears TCP_QUICKACK on its own, so profiles that want it set it again after each read
+     */
+#ifdef TCP_QUICKACK
+    if(tuning->quickAck > 0)
+    {
+        setOption(sockfd, IPPROTO_TCP, TCP_QUICKACK, tuning->quickAck);
+    }
+#else
+    (void)sockfd;
+    (void)tuning;
+#endif
+}
+
+static void appendOption(int sockfd, int level, int name, const char *label, char *buffer, size_t capacity)
+{
+    /**
+     * Append "label=value" as the kernel reports it, or "label=?" if it cannot be read
+     */
+    int       value  = 0;
+    socklen_t length = sizeof(value);
+
+    if(getsockopt(sockfd, level, name, &value, &length) == -1)
+    {
+        appendText(buffer, capacity, " %s=?", label);
+        return;
+    }
+    appendText(buffer, capacity, " %s=%d", label, value);
+}
+
+static int effectiveBacklog(int backlog)
+{
+    /**
+     * listen() silently clamps the backlog to net.core.somaxconn
+     */
+    FILE *file = fopen(SOMAXCONN_PATH, "r");
+    int   limit;
+
+    if(file == NULL)
+    {
+        return backlog;
+    }
+    if(fscanf(file, "%d", &limit) != 1 || limit >= backlog)
+    {
+        limit = backlog;
+    }
+    fclose(file);
+    return limit;
+}
+
+void describeSocketTuning(int sockfd, const SocketTuning *tuning, char *buffer, size_t capacity)
+{
+    /**
+     * Describe the values the kernel actually uses for a tuned socket (Linux reports doubled buffer sizes)
+     */
+    snprintf(buffer, capacity, "profile %s:", tuning->name);
+    appendOption(sockfd, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", buffer, capacity);
+#ifdef TCP_QUICKACK
+    appendOption(sockfd, IPPROTO_TCP, TCP_QUICKACK, "TCP_QUICKACK", buffer, capacity);
+#endif
+#ifdef SO_BUSY_POLL
+    appendOption(sockfd, SOL_SOCKET, SO_BUSY_POLL, "SO_BUSY_POLL", buffer, capacity);
+#endif
+    appendOption(sockfd, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", buffer, capacity);
+    appendOption(sockfd, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", buffer, capacity);
+#ifdef TCP_NOTSENT_LOWAT
+    appendOption(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, "TCP_NOTSENT_LOWAT", buffer, capacity);
+#endif
+    appendOption(sockfd, SOL_SOCKET, SO_KEEPALIVE, "SO_KEEPALIVE", buffer, capacity);
+#ifdef TCP_KEEPIDLE
+    appendOption(sockfd, IPPROTO_TCP, TCP_KEEPIDLE, "TCP_KEEPIDLE", buffer, capacity);
+#endif
+#ifdef TCP_KEEPINTVL
+    appendOption(sockfd, IPPROTO_TCP, TCP_KEEPINTVL, "TCP_KEEPINTVL", buffer, capacity);
+#endif
+#ifdef TCP_KEEPCNT
+    appendOption(sockfd, IPPROTO_TCP, TCP_KEEPCNT, "TCP_KEEPCNT", buffer, capacity);
+#endif
+
+    if(tuning->backlog != TUNING_UNSET)
+    {
+        appendText(buffer, capacity, " backlog=%d", effectiveBacklog(tuning->backlog));
+    }
+}
+
+bool raiseDescriptorLimit(uint64_t *soft, uint64_t *hard)
+{
+    /**
+     * Raise the soft open file limit to the hard limit, every connection costs one descriptor
+     * Return False if the limits cannot be read, otherwise report the limits now in force
+     */
+    struct rlimit limit;
+
+    if(getrlimit(RLIMIT_NOFILE, &limit) == -1)
+    {
+        return false;
+    }
+
+    if(limit.rlim_cur < limit.rlim_max)
+    {
+        struct rlimit raised = limit;
+
+        raised.rlim_cur = limit.rlim_max;
+#ifdef OPEN_MAX
+        // macOS refuses an unlimited soft limit
+        if(raised.rlim_cur > OPEN_MAX)
+        {
+            raised.rlim_cur = OPEN_MAX;
+        }
+#endif
+        if(setrlimit(RLIMIT_NOFILE, &raised) == 0)
+        {
+            limit = raised;
+        }
+    }
+
+    *soft = (uint64_t)limit.rlim_cur;
+    *hard = (uint64_t)limit.rlim_max;
+    return true;
+}